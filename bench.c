@@ -0,0 +1,465 @@
+/*
+ * Microbenchmarks of the queue operations.
+ * Every q_* function is timed on queues of 10 up to 10^7 elements, holding
+ * strings of several length distributions, and the results are written as
+ * JSON for scripts/compare_bench.py.  Built twice by "make bench": linked
+ * with the harness, and with the plain allocator of bench_alloc.c.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+#include "random.h"
+#include "report.h"
+
+#ifdef BENCH_HARNESS
+#define BENCH_ALLOCATOR "harness"
+#else
+#define BENCH_ALLOCATOR "libc"
+#endif
+
+#ifdef QUEUE_UNROLLED
+#define BENCH_QUEUE "unrolled"
+#else
+#define BENCH_QUEUE "list"
+#endif
+
+/* Fewest operations timed together in a sample */
+#define MIN_SAMPLE_OPS 100000
+/* Calls per sample of operations on the whole queue */
+#define WHOLE_QUEUE_WORK 10000000
+/* Distinct strings of each length distribution */
+#define NR_STRINGS 65536
+/* Estimated bytes of an element besides its string */
+#define ELEMENT_OVERHEAD 64
+#define MAXSTRING 1024
+
+/* Length distribution of the stored strings */
+typedef struct {
+    const char *name;
+    size_t min_len, max_len;
+} strings_t;
+
+static const strings_t string_dists[] = {
+    {"short", 7, 7},
+    {"mixed", 1, 63},
+    {"long", 255, 255},
+};
+#define NR_DISTS (sizeof(string_dists) / sizeof(string_dists[0]))
+
+/* Sample of n strings, from a set of at most NR_STRINGS distinct ones */
+typedef struct {
+    size_t n;
+    char **strs;
+} input_t;
+
+/*
+ * A benchmark builds its queue with setup, untimed, and then run does the
+ * timed work on it and returns the number of operations done.  run may
+ * free the queue, in which case it sets *qp to NULL.
+ */
+typedef struct {
+    const char *name;
+    queue_t *(*setup)(input_t *in);
+    size_t (*run)(queue_t **qp, input_t *in);
+} bench_t;
+
+/* Keeps results of timed calls from being optimized away */
+static volatile uintptr_t sink;
+
+static queue_t *setup_empty(input_t *in)
+{
+    return q_new();
+}
+
+static queue_t *setup_full(input_t *in)
+{
+    queue_t *q = q_new();
+    if (q && !q_insert_tail_bulk(q, in->strs, in->n)) {
+        q_free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static size_t run_insert_head(queue_t **qp, input_t *in)
+{
+    for (size_t i = 0; i < in->n; i++)
+        q_insert_head(*qp, in->strs[i]);
+    return in->n;
+}
+
+static size_t run_insert_tail(queue_t **qp, input_t *in)
+{
+    for (size_t i = 0; i < in->n; i++)
+        q_insert_tail(*qp, in->strs[i]);
+    return in->n;
+}
+
+static size_t run_insert_head_bulk(queue_t **qp, input_t *in)
+{
+    q_insert_head_bulk(*qp, in->strs, in->n);
+    return in->n;
+}
+
+static size_t run_insert_tail_bulk(queue_t **qp, input_t *in)
+{
+    q_insert_tail_bulk(*qp, in->strs, in->n);
+    return in->n;
+}
+
+static size_t run_remove_head(queue_t **qp, input_t *in)
+{
+    char buf[MAXSTRING];
+    for (size_t i = 0; i < in->n; i++)
+        q_remove_head(*qp, buf, sizeof(buf));
+    return in->n;
+}
+
+static size_t run_remove_tail(queue_t **qp, input_t *in)
+{
+    char buf[MAXSTRING];
+    for (size_t i = 0; i < in->n; i++)
+        q_remove_tail(*qp, buf, sizeof(buf));
+    return in->n;
+}
+
+static size_t run_pop_head(queue_t **qp, input_t *in)
+{
+    for (size_t i = 0; i < in->n; i++)
+        q_release(q_pop_head(*qp));
+    return in->n;
+}
+
+static size_t run_free(queue_t **qp, input_t *in)
+{
+    q_free(*qp);
+    *qp = NULL;
+    return in->n;
+}
+
+static size_t run_iter(queue_t **qp, input_t *in)
+{
+    q_iter_t it;
+    char *s;
+    q_iter_init(&it, *qp);
+    while ((s = q_iter_next(&it)))
+        sink = (uintptr_t) s;
+    return in->n;
+}
+
+static size_t run_peek(queue_t **qp, input_t *in)
+{
+    for (size_t i = 0; i < MIN_SAMPLE_OPS; i++)
+        sink = (uintptr_t) q_peek_head(*qp) ^ (uintptr_t) q_peek_tail(*qp);
+    return MIN_SAMPLE_OPS;
+}
+
+static size_t run_size(queue_t **qp, input_t *in)
+{
+    for (size_t i = 0; i < MIN_SAMPLE_OPS; i++)
+        sink = q_size(*qp);
+    return MIN_SAMPLE_OPS;
+}
+
+/* Constant time on some layouts and linear on others */
+static size_t run_reverse(queue_t **qp, input_t *in)
+{
+    size_t calls = in->n < WHOLE_QUEUE_WORK ? WHOLE_QUEUE_WORK / in->n : 1;
+    for (size_t i = 0; i < calls; i++)
+        q_reverse(*qp);
+    return calls;
+}
+
+/* Reports time per element, to compare sizes against n log n */
+static size_t run_sort(queue_t **qp, input_t *in)
+{
+    q_sort(*qp);
+    return in->n;
+}
+
+static const bench_t benches[] = {
+    {"insert_head", setup_empty, run_insert_head},
+    {"insert_tail", setup_empty, run_insert_tail},
+    {"insert_head_bulk", setup_empty, run_insert_head_bulk},
+    {"insert_tail_bulk", setup_empty, run_insert_tail_bulk},
+    {"remove_head", setup_full, run_remove_head},
+    {"remove_tail", setup_full, run_remove_tail},
+    {"pop_head", setup_full, run_pop_head},
+    {"free", setup_full, run_free},
+    {"iter", setup_full, run_iter},
+    {"peek", setup_full, run_peek},
+    {"size", setup_full, run_size},
+    {"reverse", setup_full, run_reverse},
+    {"sort", setup_full, run_sort},
+};
+#define NR_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* Strings of distribution d, in a set shared by all sizes */
+static char **make_strings(const strings_t *d)
+{
+    char **set = malloc(NR_STRINGS * sizeof(char *));
+    if (!set)
+        return NULL;
+    for (size_t i = 0; i < NR_STRINGS; i++) {
+        size_t len = d->min_len + prng_below(d->max_len - d->min_len + 1);
+        set[i] = malloc(len + 1);
+        if (!set[i])
+            return NULL;
+        for (size_t j = 0; j < len; j++)
+            set[i][j] = 'a' + prng_below(26);
+        set[i][len] = '\0';
+    }
+    return set;
+}
+
+/*
+ * Time one sample of bench b: enough rounds of setup, run and teardown to
+ * cover MIN_SAMPLE_OPS operations or elements, of which only run is timed.
+ * Return false if the queue could not be built.
+ */
+static bool sample(const bench_t *b,
+                   input_t *in,
+                   size_t *ops,
+                   uint64_t *ns,
+                   double *bytes)
+{
+    *ops = 0;
+    *ns = 0;
+    *bytes = 0;
+    size_t elements = 0;
+    do {
+        queue_t *q = b->setup(in);
+        if (!q)
+            return false;
+        size_t before = allocation_bytes();
+        uint64_t start = now_ns();
+        size_t done = b->run(&q, in);
+        *ns += now_ns() - start;
+        *bytes += (double) allocation_bytes() - (double) before;
+        *ops += done;
+        elements += in->n;
+        q_free(q);
+    } while (*ops < MIN_SAMPLE_OPS && elements < MIN_SAMPLE_OPS);
+    return true;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Results of one benchmark at one size and length distribution */
+typedef struct {
+    const bench_t *bench;
+    const strings_t *dist;
+    size_t n;
+    size_t ops;        /* Operations per sample */
+    double bytes;      /* Change of allocated bytes per operation */
+    double *ns_per_op; /* One value per timed pass */
+    bool failed;       /* Queue could not be built */
+} result_t;
+
+/* Sample strings of dist d in strs, the same ones in every pass */
+static void pick_strings(char **strs, char **set, size_t d, size_t n)
+{
+    prng_seed(1 + d * 64 + __builtin_ctzll(n));
+    for (size_t i = 0; i < n; i++)
+        strs[i] = set[prng_below(NR_STRINGS)];
+}
+
+static void write_results(FILE *out,
+                          result_t *results,
+                          size_t nr_results,
+                          int reps,
+                          int warmup)
+{
+    fprintf(out,
+            "{\n \"allocator\": \"%s\",\n \"queue\": \"%s\",\n"
+            " \"reps\": %d,\n \"warmup\": %d,\n \"results\": [",
+            BENCH_ALLOCATOR, BENCH_QUEUE, reps, warmup);
+    bool first = true;
+    for (result_t *r = results; r < results + nr_results; r++) {
+        if (r->failed)
+            continue;
+        fprintf(out,
+                "%s\n  {\"op\": \"%s\", \"strings\": \"%s\", "
+                "\"n\": %zu, \"ops\": %zu, \"bytes_per_op\": %.2f, "
+                "\"ns_per_op\": [",
+                first ? "" : ",", r->bench->name, r->dist->name, r->n,
+                r->ops, r->bytes);
+        for (int i = 0; i < reps; i++)
+            fprintf(out, "%s%.3f", i ? ", " : "", r->ns_per_op[i]);
+        fprintf(out, "]}");
+        first = false;
+    }
+    fprintf(out, "\n ]\n}\n");
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-o OFILE][-n MAXN][-r REPS][-w WARMUP][-m MB]"
+           "[-t OP]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-o OFILE   Write JSON results to OFILE instead of stdout\n");
+    printf("\t-n MAXN    Largest queue size (default 10000000)\n");
+    printf("\t-r REPS    Timed samples per benchmark (default 5)\n");
+    printf("\t-w WARMUP  Untimed samples before them (default 1)\n");
+    printf("\t-m MB      Skip sizes needing more memory (default 2048)\n");
+    printf("\t-t OP      Only run benchmark OP\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    char *outfile_name = NULL;
+    char *only = NULL;
+    size_t max_n = 10000000;
+    int reps = 5, warmup = 1;
+    double mem_limit = 2048;
+    int c;
+
+    while ((c = getopt(argc, argv, "ho:n:r:w:m:t:")) != -1) {
+        switch (c) {
+        case 'o':
+            outfile_name = optarg;
+            break;
+        case 'n':
+            max_n = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'm':
+            mem_limit = atof(optarg);
+            break;
+        case 't':
+            only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (reps < 1)
+        reps = 1;
+    if (warmup < 0)
+        warmup = 0;
+    if (max_n > 10000000)
+        max_n = 10000000;
+
+    FILE *out = outfile_name ? fopen(outfile_name, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Couldn't open '%s'\n", outfile_name);
+        return 1;
+    }
+
+    /* Same strings in every run, so that results can be compared */
+    char **sets[NR_DISTS];
+    prng_seed(1);
+    for (size_t d = 0; d < NR_DISTS; d++) {
+        sets[d] = make_strings(&string_dists[d]);
+        if (!sets[d])
+            return 1;
+    }
+    char **strs = malloc((max_n ? max_n : 1) * sizeof(char *));
+    result_t *results = calloc(NR_DISTS * 8 * NR_BENCHES, sizeof(result_t));
+    if (!strs || !results)
+        return 1;
+
+    size_t nr_results = 0;
+    for (size_t d = 0; d < NR_DISTS; d++) {
+        const strings_t *dist = &string_dists[d];
+        double est = dist->max_len + 1 + ELEMENT_OVERHEAD;
+        for (size_t n = 10; n <= max_n; n *= 10) {
+            if (n * est > mem_limit * 1024 * 1024) {
+                fprintf(stderr, "%s strings: skipping n = %zu\n", dist->name,
+                        n);
+                continue;
+            }
+            for (size_t k = 0; k < NR_BENCHES; k++) {
+                if (only && strcmp(only, benches[k].name) != 0)
+                    continue;
+                result_t *r = &results[nr_results++];
+                r->bench = &benches[k];
+                r->dist = dist;
+                r->n = n;
+                r->ns_per_op = calloc(reps, sizeof(double));
+                if (!r->ns_per_op)
+                    return 1;
+            }
+        }
+    }
+
+    /*
+     * Each pass runs every benchmark once, so that the samples of a
+     * benchmark are spread over the whole run, and slow drifts of the
+     * machine show up in their spread rather than as a difference.
+     */
+    for (int pass = -warmup; pass < reps; pass++) {
+        fprintf(stderr, "%s %d of %d\n", pass < 0 ? "Warmup" : "Pass",
+                pass < 0 ? pass + warmup + 1 : pass + 1,
+                pass < 0 ? warmup : reps);
+        size_t picked_n = 0, picked_d = NR_DISTS;
+        for (result_t *r = results; r < results + nr_results; r++) {
+            size_t d = r->dist - string_dists;
+            if (r->failed)
+                continue;
+            if (r->n != picked_n || d != picked_d) {
+                pick_strings(strs, sets[d], d, r->n);
+                picked_n = r->n;
+                picked_d = d;
+            }
+            input_t in = {r->n, strs};
+            uint64_t ns;
+            double bytes;
+            if (!sample(r->bench, &in, &r->ops, &ns, &bytes)) {
+                fprintf(stderr, "%s on %zu %s strings: out of memory\n",
+                        r->bench->name, r->n, r->dist->name);
+                r->failed = true;
+                continue;
+            }
+            r->bytes = bytes / r->ops;
+            if (pass >= 0)
+                r->ns_per_op[pass] = (double) ns / r->ops;
+        }
+    }
+
+    write_results(out, results, nr_results, reps, warmup);
+
+    double *sorted = malloc(reps * sizeof(double));
+    for (result_t *r = results; sorted && r < results + nr_results; r++) {
+        if (r->failed)
+            continue;
+        memcpy(sorted, r->ns_per_op, reps * sizeof(double));
+        qsort(sorted, reps, sizeof(double), cmp_double);
+        fprintf(stderr, "%-16s %-5s n = %-8zu %10.2f ns/op %8.2f B/op\n",
+                r->bench->name, r->dist->name, r->n, sorted[reps / 2],
+                r->bytes);
+    }
+    free(sorted);
+
+    for (result_t *r = results; r < results + nr_results; r++)
+        free(r->ns_per_op);
+    free(results);
+    free(strs);
+    for (size_t d = 0; d < NR_DISTS; d++) {
+        for (size_t i = 0; i < NR_STRINGS; i++)
+            free(sets[d][i]);
+        free(sets[d]);
+    }
+    return fclose(out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * Plain libc stand-in for the allocation functions of harness.c, so that
+ * the queue code can be benchmarked without the harness checks.  Blocks
+ * only carry what pools need to release them, and their size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERNAL 1
+#include "harness.h"
+
+typedef struct BLOCK block_t;
+struct BLOCK {
+    struct POOL *pool;    /* Pool holding block, or NULL */
+    block_t *prev, *next; /* Neighbours among the blocks of pool */
+    size_t size;
+};
+
+struct POOL {
+    block_t *blocks;
+};
+
+static size_t live_bytes = 0;
+
+size_t allocation_bytes()
+{
+    return live_bytes;
+}
+
+static void *block_alloc(struct POOL *pool, size_t size)
+{
+    block_t *b = malloc(sizeof(block_t) + size);
+    if (!b)
+        return NULL;
+    b->pool = pool;
+    b->size = size;
+    b->prev = NULL;
+    b->next = NULL;
+    if (pool) {
+        b->next = pool->blocks;
+        if (pool->blocks)
+            pool->blocks->prev = b;
+        pool->blocks = b;
+    }
+    live_bytes += size;
+    return b + 1;
+}
+
+void *test_malloc(size_t size)
+{
+    return block_alloc(NULL, size);
+}
+
+void *test_calloc(size_t nelem, size_t elsize)
+{
+    size_t size = nelem * elsize;
+    void *p = test_malloc(size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+void test_free(void *p)
+{
+    if (!p)
+        return;
+    block_t *b = (block_t *) p - 1;
+    if (b->pool) {
+        if (b->prev)
+            b->prev->next = b->next;
+        else
+            b->pool->blocks = b->next;
+        if (b->next)
+            b->next->prev = b->prev;
+    }
+    live_bytes -= b->size;
+    free(b);
+}
+
+char *test_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p = test_malloc(len);
+    if (p)
+        memcpy(p, s, len);
+    return p;
+}
+
+struct POOL *test_pool_new()
+{
+    return calloc(1, sizeof(struct POOL));
+}
+
+void *test_pool_malloc(struct POOL *pool, size_t size)
+{
+    return block_alloc(pool, size);
+}
+
+bool test_pool_malloc_n(struct POOL *pool,
+                        const size_t *sizes,
+                        void **ptrs,
+                        size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        ptrs[i] = block_alloc(pool, sizes[i]);
+        if (!ptrs[i]) {
+            while (i--)
+                test_free(ptrs[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_pool_release(struct POOL *pool)
+{
+    if (!pool)
+        return;
+    block_t *b = pool->blocks;
+    while (b) {
+        block_t *next = b->next;
+        live_bytes -= b->size;
+        free(b);
+        b = next;
+    }
+    free(pool);
+}
@@ -1,6 +1,7 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -8,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,7 +19,7 @@
 #include "report.h"
 
 /* Some global values */
-bool simulation = false;
+int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
 static bool block_flag = false;
@@ -33,6 +35,7 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are memory-mapped instead, and lines are found with memchr.
  */
 
 #define RIO_BUFSIZE 8192
@@ -43,11 +46,37 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Contents of mapped file, or NULL if read */
+    size_t map_len;        /* Length of mapped file */
+    size_t map_pos;        /* Offset of next unread byte in map */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
-static char linebuf[RIO_BUFSIZE];
+
+/*
+ * Line being interpreted.  Lines read from a buffer are cut off to fit the
+ * initial size, while lines from a mapped file grow it as needed.
+ */
+static char line_init[RIO_BUFSIZE];
+static char *linebuf = line_init;
+static size_t linebuf_size = RIO_BUFSIZE;
+
+/* Words of the line being interpreted, which point into linebuf */
+#define MAXARGS (RIO_BUFSIZE / 2)
+static char *argv_init[MAXARGS];
+static char **argv_buf = argv_init;
+
+/*
+ * Commands and parameters are also indexed by name in open-addressing hash
+ * tables, so that looking one up does not walk the sorted lists.
+ * Tables are kept at most half full.
+ */
+#define HASH_SIZE 256
+static cmd_ptr cmd_table[HASH_SIZE];
+static param_ptr param_table[HASH_SIZE];
+static int cmd_cnt = 0;
+static int param_cnt = 0;
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -55,7 +84,8 @@ static int fd_max = 0;
 /* Parameters */
 static int err_limit = 5;
 static int err_cnt = 0;
-static bool echo = 0;
+static int echo = 0;
+static int timing = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -66,6 +96,10 @@ static char *prompt = "cmd> ";
 #define MAXQUIT 10
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
+static cmd_function reset_helpers[MAXQUIT];
+static int reset_helper_cnt = 0;
+static cmd_hook_function cmd_hook = NULL;
+static cmd_hook_function cmd_done_hook = NULL;
 
 static bool do_quit_cmd(int argc, char *argv[]);
 static bool do_help_cmd(int argc, char *argv[]);
@@ -74,8 +108,12 @@ static bool do_source_cmd(int argc, char *argv[]);
 static bool do_log_cmd(int argc, char *argv[]);
 static bool do_time_cmd(int argc, char *argv[]);
 static bool do_comment_cmd(int argc, char *argv[]);
+static bool do_latency_cmd(int argc, char *argv[]);
+static bool do_reset_cmd(int argc, char *argv[]);
 
 static void init_in();
+static void free_line();
+static void clear_tables();
 
 static bool push_file(char *fname);
 static void pop_file();
@@ -87,6 +125,7 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    clear_tables();
     err_cnt = 0;
     quit_flag = false;
 
@@ -94,22 +133,90 @@ void init_cmd()
     add_cmd("option", do_option_cmd,
             " [name val]     | Display or set options");
     add_cmd("quit", do_quit_cmd, "                | Exit program");
+    add_cmd("reset", do_reset_cmd,
+            "                | Restore starting state, report errors");
     add_cmd("source", do_source_cmd,
             " file           | Read commands from source file");
     add_cmd("log", do_log_cmd, " file           | Copy output to file");
     add_cmd("time", do_time_cmd, " cmd arg ...    | Time command execution");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
-    add_param("simulation", (int *) &simulation, "Start/Stop simulation mode",
-              NULL);
+    add_cmd("latency", do_latency_cmd,
+            " [file]         | Show or save latency of timed commands");
+    add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
-    add_param("echo", (int *) &echo, "Do/don't echo commands", NULL);
+    add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("timing", &timing, "Record latency of each command", NULL);
 
     init_in();
     init_time(&last_time);
     first_time = last_time;
 }
 
+/* FNV-1a hash of string */
+static uint32_t fnv1a(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Hash of name, reduced to a table index */
+static size_t hash_name(const char *name)
+{
+    return fnv1a(name) & (HASH_SIZE - 1);
+}
+
+static void clear_tables()
+{
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = 0;
+    param_cnt = 0;
+}
+
+/* Find the command called name, or return NULL */
+static cmd_ptr find_cmd(const char *name)
+{
+    size_t i = hash_name(name);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, name) != 0)
+        i = (i + 1) & (HASH_SIZE - 1);
+    return cmd_table[i];
+}
+
+/* Find the parameter called name, or return NULL */
+static param_ptr find_param(const char *name)
+{
+    size_t i = hash_name(name);
+    while (param_table[i] && strcmp(param_table[i]->name, name) != 0)
+        i = (i + 1) & (HASH_SIZE - 1);
+    return param_table[i];
+}
+
+/* Index ele by name.  A later command of the same name replaces it */
+static void index_cmd(cmd_ptr ele)
+{
+    size_t i = hash_name(ele->name);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, ele->name) != 0)
+        i = (i + 1) & (HASH_SIZE - 1);
+    if (!cmd_table[i] && ++cmd_cnt > HASH_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+    cmd_table[i] = ele;
+}
+
+static void index_param(param_ptr ele)
+{
+    size_t i = hash_name(ele->name);
+    while (param_table[i] && strcmp(param_table[i]->name, ele->name) != 0)
+        i = (i + 1) & (HASH_SIZE - 1);
+    if (!param_table[i] && ++param_cnt > HASH_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+    param_table[i] = ele;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -124,8 +231,10 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->latency = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+    index_cmd(ele);
 }
 
 /* Add a new parameter */
@@ -146,54 +255,70 @@ void add_param(char *name,
     ele->valp = valp;
     ele->documentation = documentation;
     ele->setter = setter;
+    ele->reset_val = *valp;
     ele->next = next_param;
     *last_loc = ele;
+    index_param(ele);
+}
+
+/*
+ * Make room in linebuf for a line of len characters plus newline and null.
+ * Since words are separated by white space, argv_buf needs at most half as
+ * many entries.
+ */
+static void reserve_line(size_t len)
+{
+    if (len + 2 <= linebuf_size)
+        return;
+
+    size_t size = linebuf_size;
+    while (size < len + 2)
+        size *= 2;
+    free_line();
+    linebuf = malloc_or_fail(size, "reserve_line");
+    argv_buf = malloc_or_fail(size / 2 * sizeof(char *), "reserve_line");
+    linebuf_size = size;
+}
+
+/* Go back to initial line buffer */
+static void free_line()
+{
+    if (linebuf == line_init)
+        return;
+    free_block(linebuf, linebuf_size);
+    free_block(argv_buf, linebuf_size / 2 * sizeof(char *));
+    linebuf = line_init;
+    argv_buf = argv_init;
+    linebuf_size = RIO_BUFSIZE;
 }
 
-/* Parse a string into a command line */
+/*
+ * Split line into words in place, by replacing the white space after each
+ * word with a null character.  The words are collected in argv_buf, so they
+ * last only until the next line is parsed or read.
+ */
 static char **parse_args(char *line, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
     char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
-    }
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+    for (;;) {
+        while (isspace((unsigned char) *src))
+            src++;
+        if (*src == '\0')
+            break;
+        /* Hit start of new word */
+        argv_buf[argc++] = src;
+        while (*src != '\0' && !isspace((unsigned char) *src))
+            src++;
+        if (*src == '\0')
+            break;
+        /* Hit end of word */
+        *src++ = '\0';
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return argv_buf;
 }
 
 static void record_error()
@@ -205,6 +330,89 @@ static void record_error()
     }
 }
 
+/*
+ * Latency histogram of a command.  Values below LAT_SUB nanoseconds have a
+ * bucket each, and every larger power of 2 is split into LAT_SUB buckets,
+ * so a value is known to within 1 part in LAT_SUB.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct LATENCY {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+static size_t lat_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int k = 63 - __builtin_clzll(ns);
+    return (k - LAT_SUB_BITS + 1) * LAT_SUB +
+           ((ns >> (k - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* Highest value that falls in bucket i */
+static uint64_t lat_bucket_top(size_t i)
+{
+    if (i < LAT_SUB)
+        return i;
+    int shift = i / LAT_SUB - 1;
+    uint64_t low = (uint64_t) (LAT_SUB + i % LAT_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static void record_latency(cmd_ptr cmd, uint64_t ns)
+{
+    struct LATENCY *lat = cmd->latency;
+    if (!lat) {
+        lat = cmd->latency =
+            calloc_or_fail(1, sizeof(struct LATENCY), "record_latency");
+    }
+    lat->count++;
+    if (ns > lat->max)
+        lat->max = ns;
+    lat->buckets[lat_bucket(ns)]++;
+}
+
+/* Latency not exceeded by fraction p of the calls */
+static uint64_t lat_percentile(struct LATENCY *lat, double p)
+{
+    /* Nearest rank, rounding up */
+    uint64_t rank = (uint64_t) (p * lat->count);
+    if (rank < p * lat->count || rank < 1)
+        rank++;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = lat_bucket_top(i);
+            return top < lat->max ? top : lat->max;
+        }
+    }
+    return lat->max;
+}
+
+/* Run command that has been looked up already */
+static bool run_cmd(cmd_ptr cmd, int argc, char *argv[])
+{
+    if (cmd_hook)
+        cmd_hook(cmd->name);
+    bool timed = timing;
+    uint64_t start = timed ? now_ns() : 0;
+    bool ok = cmd->operation(argc, argv);
+    /* Commands are freed by quit */
+    if (timed && !quit_flag)
+        record_latency(cmd, now_ns() - start);
+    if (cmd_done_hook && !quit_flag)
+        cmd_done_hook(cmd->name);
+    if (!ok)
+        record_error();
+    return ok;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
@@ -212,14 +420,10 @@ static bool interpret_cmda(int argc, char *argv[])
         return true;
 
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
-        if (!ok)
-            record_error();
+        ok = run_cmd(next_cmd, argc, argv);
     } else {
         report(1, "Unknown command '%s'", argv[0]);
         record_error();
@@ -240,12 +444,7 @@ static bool interpret_cmd(char *cmdline)
 #endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -257,6 +456,25 @@ void add_quit_helper(cmd_function qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be executed by the reset command */
+void add_reset_helper(cmd_function rf)
+{
+    if (reset_helper_cnt < MAXQUIT)
+        reset_helpers[reset_helper_cnt++] = rf;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on reset helpers");
+}
+
+void set_cmd_hook(cmd_hook_function hook)
+{
+    cmd_hook = hook;
+}
+
+void set_cmd_done_hook(cmd_hook_function hook)
+{
+    cmd_done_hook = hook;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -271,6 +489,8 @@ static bool do_quit_cmd(int argc, char *argv[])
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(struct LATENCY));
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -280,6 +500,9 @@ static bool do_quit_cmd(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    clear_tables();
 
     while (buf_stack)
         pop_file();
@@ -292,6 +515,38 @@ static bool do_quit_cmd(int argc, char *argv[])
     return ok;
 }
 
+/*
+ * Put the program back in the state it started running commands in, so
+ * that one process can run trace after trace.  The final line says whether
+ * the commands since the last reset ran without errors.
+ */
+static bool do_reset_cmd(int argc, char *argv[])
+{
+    bool ok = err_cnt == 0;
+    for (int i = 0; i < reset_helper_cnt; i++)
+        ok = reset_helpers[i](argc, argv) && ok;
+
+    for (param_ptr p = param_list; p; p = p->next) {
+        int oldval = *p->valp;
+        if (oldval == p->reset_val)
+            continue;
+        *p->valp = p->reset_val;
+        if (p->setter)
+            p->setter(oldval);
+    }
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        if (c->latency) {
+            free_block(c->latency, sizeof(struct LATENCY));
+            c->latency = NULL;
+        }
+    }
+    err_cnt = 0;
+
+    /* Printed at every verbosity, since drivers wait for it */
+    report(0, "Reset: %s", ok ? "ok" : "failed");
+    return true;
+}
+
 static bool do_help_cmd(int argc, char *argv[])
 {
     cmd_ptr clist = cmd_list;
@@ -336,6 +591,19 @@ bool get_int(char *vname, int *loc)
     return true;
 }
 
+/* Extract 64-bit integer from text, as used for repetition counts */
+bool get_int64(char *vname, int64_t *loc)
+{
+    char *end = NULL;
+    errno = 0;
+    long long int v = strtoll(vname, &end, 0);
+    if (errno == ERANGE || end == vname || *end != '\0')
+        return false;
+
+    *loc = (int64_t) v;
+    return true;
+}
+
 static bool do_option_cmd(int argc, char *argv[])
 {
     if (argc == 1) {
@@ -352,7 +620,6 @@ static bool do_option_cmd(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -361,25 +628,85 @@ static bool do_option_cmd(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        param_ptr param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
+    }
+
+    return true;
+}
+
+/* Save latency of each timed command to file_name, as CSV or JSON */
+static bool export_latency(char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+
+    size_t len = strlen(file_name);
+    bool csv = len >= 4 && strcmp(file_name + len - 4, ".csv") == 0;
+    bool first = true;
+    if (csv)
+        fprintf(f, "command,calls,p50_ns,p90_ns,p99_ns,max_ns\n");
+    else
+        fprintf(f, "{");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        struct LATENCY *lat = c->latency;
+        if (!lat)
+            continue;
+        uint64_t p50 = lat_percentile(lat, 0.5);
+        uint64_t p90 = lat_percentile(lat, 0.9);
+        uint64_t p99 = lat_percentile(lat, 0.99);
+        if (csv)
+            fprintf(f,
+                    "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                    ",%" PRIu64 "\n",
+                    c->name, lat->count, p50, p90, p99, lat->max);
+        else
+            fprintf(f,
+                    "%s\n \"%s\": {\"calls\": %" PRIu64
+                    ", \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64
+                    ", \"p99_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+                    first ? "" : ",", c->name, lat->count, p50, p90, p99,
+                    lat->max);
+        first = false;
+    }
+    if (!csv)
+        fprintf(f, "\n}\n");
+    return fclose(f) == 0;
+}
+
+static bool do_latency_cmd(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+    if (argc == 2) {
+        bool ok = export_latency(argv[1]);
+        if (!ok)
+            report(1, "Couldn't write latency to '%s'", argv[1]);
+        return ok;
     }
 
+    report(1, "Latency (ns):");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        struct LATENCY *lat = c->latency;
+        if (!lat)
+            continue;
+        report(1,
+               "\t%s\t%" PRIu64 " calls, p50 %" PRIu64 ", p90 %" PRIu64
+               ", p99 %" PRIu64 ", max %" PRIu64,
+               c->name, lat->count, lat_percentile(lat, 0.5),
+               lat_percentile(lat, 0.9), lat_percentile(lat, 0.99),
+               lat->max);
+    }
     return true;
 }
 
@@ -434,6 +761,7 @@ static bool do_time_cmd(int argc, char *argv[])
 
 /* Create new buffer for named file.
  * Name == NULL for stdin.
+ * Non-empty regular files are mapped rather than read into the buffer.
  * Return true if successful.
  */
 static bool push_file(char *fname)
@@ -449,6 +777,22 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = 0;
+
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (uintmax_t) st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        /* Fall back to reading if the file cannot be mapped */
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -461,6 +805,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -472,6 +818,39 @@ static void init_in()
     buf_stack = NULL;
 }
 
+static void echo_line()
+{
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, linebuf);
+    }
+}
+
+/* Copy next line of mapped file into linebuf, or return NULL at EOF */
+static char *readline_map()
+{
+    rio_ptr r = buf_stack;
+    if (r->map_pos >= r->map_len) {
+        pop_file();
+        return NULL;
+    }
+
+    char *start = r->map + r->map_pos;
+    size_t avail = r->map_len - r->map_pos;
+    char *nl = memchr(start, '\n', avail);
+    /* Last line of file need not terminate with newline */
+    size_t len = nl ? (size_t) (nl - start) : avail;
+    r->map_pos += nl ? len + 1 : len;
+
+    reserve_line(len);
+    memcpy(linebuf, start, len);
+    linebuf[len] = '\n';
+    linebuf[len + 1] = '\0';
+    echo_line();
+
+    return linebuf;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -484,6 +863,9 @@ static char *readline()
     if (!buf_stack)
         return NULL;
 
+    if (buf_stack->map)
+        return readline_map();
+
     for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
@@ -497,10 +879,7 @@ static char *readline()
                     /*  Terminate line & return it */
                     *lptr++ = '\n';
                     *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
+                    echo_line();
                     return linebuf;
                 }
                 return NULL;
@@ -520,11 +899,7 @@ static char *readline()
         *lptr++ = '\n';
     }
     *lptr++ = '\0';
-
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
-    }
+    echo_line();
 
     return linebuf;
 }
@@ -532,6 +907,10 @@ static char *readline()
 /* Determine if there is a complete command line in input buffer */
 static bool read_ready()
 {
+    /* Whatever is left of a mapped file ends in a complete line */
+    if (buf_stack && buf_stack->map)
+        return buf_stack->map_pos < buf_stack->map_len;
+
     for (int i = 0; buf_stack && i < buf_stack->cnt; i++) {
         if (buf_stack->bufptr[i] == '\n')
             return true;
@@ -583,7 +962,6 @@ int cmd_select(int nfds,
         FD_SET(infd, readfds);
         if (infd == STDIN_FILENO && prompt_flag) {
             printf("%s", prompt);
-            fflush(stdout);
             prompt_flag = true;
         }
 
@@ -593,6 +971,8 @@ int cmd_select(int nfds,
     if (nfds == 0)
         return 0;
 
+    /* Show everything before waiting for input */
+    report_flush();
     int result = select(nfds, readfds, writefds, exceptfds, timeout);
     if (result <= 0)
         return result;
@@ -614,11 +994,20 @@ bool finish_cmd()
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit_cmd(0, NULL);
+    free_line();
     return ok && err_cnt == 0;
 }
 
+/* Remember parameter values for reset */
+static void save_params()
+{
+    for (param_ptr p = param_list; p; p = p->next)
+        p->reset_val = *p->valp;
+}
+
 bool run_console(char *infile_name)
 {
+    save_params();
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -628,3 +1017,376 @@ bool run_console(char *infile_name)
         cmd_select(0, NULL, NULL, NULL, NULL);
     return err_cnt == 0;
 }
+
+/*
+ * Binary traces.
+ * A compiled trace holds a header, then nstrings null-terminated strings
+ * taking strbytes bytes, then nrecords records.  A record is how many
+ * times the line repeats, the id of the command name (its opcode), the
+ * number of words on the line, and then the ids of the remaining words,
+ * each as an unsigned LEB128 varint.  Runs of identical lines share one
+ * record.  Header fields are in host byte order.
+ */
+#define TRACE_MAGIC "QTB1"
+
+typedef struct {
+    char magic[4];
+    uint32_t nstrings;
+    uint64_t strbytes;
+    uint64_t nrecords;
+} trace_header_t;
+
+/* Growable array of bytes */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} bytes_t;
+
+static void bytes_append(bytes_t *b, const void *p, size_t n)
+{
+    if (b->len + n > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        while (size < b->len + n)
+            size *= 2;
+        char *data = malloc_or_fail(size, "bytes_append");
+        if (b->data) {
+            memcpy(data, b->data, b->len);
+            free_block(b->data, b->size);
+        }
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void bytes_put_varint(bytes_t *b, uint64_t v)
+{
+    unsigned char buf[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (unsigned char) v;
+    bytes_append(b, buf, n);
+}
+
+/* Decode varint at *posp, which must end before len */
+static bool get_varint(const char *data, size_t len, size_t *posp, uint64_t *v)
+{
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && *posp < len; shift += 7) {
+        unsigned char c = data[(*posp)++];
+        x |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bytes_free(bytes_t *b)
+{
+    if (b->data)
+        free_block(b->data, b->size);
+}
+
+/* Strings of a trace being compiled, numbered in order of appearance */
+typedef struct {
+    bytes_t text;    /* The strings, each null-terminated */
+    bytes_t offsets; /* Offset in text of each string */
+    uint32_t *slots; /* Hash table of 1 + id, 0 when empty */
+    size_t nslots;
+    uint32_t cnt;
+} intern_t;
+
+static const char *intern_str(intern_t *t, uint32_t id)
+{
+    return t->text.data + ((size_t *) t->offsets.data)[id];
+}
+
+static void intern_grow(intern_t *t)
+{
+    size_t nslots = t->nslots ? 2 * t->nslots : 1024;
+    uint32_t *slots = calloc_or_fail(nslots, sizeof(uint32_t), "intern");
+    for (uint32_t id = 0; id < t->cnt; id++) {
+        size_t i = fnv1a(intern_str(t, id)) & (nslots - 1);
+        while (slots[i])
+            i = (i + 1) & (nslots - 1);
+        slots[i] = id + 1;
+    }
+    if (t->slots)
+        free_array(t->slots, t->nslots, sizeof(uint32_t));
+    t->slots = slots;
+    t->nslots = nslots;
+}
+
+/* Return id of s, adding it if it is new */
+static uint32_t intern(intern_t *t, const char *s)
+{
+    if (2 * ((size_t) t->cnt + 1) > t->nslots)
+        intern_grow(t);
+
+    size_t i = fnv1a(s) & (t->nslots - 1);
+    while (t->slots[i]) {
+        uint32_t id = t->slots[i] - 1;
+        if (strcmp(intern_str(t, id), s) == 0)
+            return id;
+        i = (i + 1) & (t->nslots - 1);
+    }
+
+    size_t offset = t->text.len;
+    bytes_append(&t->offsets, &offset, sizeof(offset));
+    bytes_append(&t->text, s, strlen(s) + 1);
+    t->slots[i] = ++t->cnt;
+    return t->cnt - 1;
+}
+
+static void intern_free(intern_t *t)
+{
+    bytes_free(&t->text);
+    bytes_free(&t->offsets);
+    if (t->slots)
+        free_array(t->slots, t->nslots, sizeof(uint32_t));
+}
+
+/*
+ * Compile commands from infile_name (stdin if NULL) into a binary trace in
+ * outfile_name.  Sourced files are compiled inline.
+ * Return true if successful.
+ */
+bool compile_trace(char *infile_name, char *outfile_name)
+{
+    if (!push_file(infile_name)) {
+        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        return false;
+    }
+
+    intern_t strs = {0};
+    bytes_t recs = {0}, line_ops = {0}, last_ops = {0};
+    trace_header_t h = {TRACE_MAGIC, 0, 0, 0};
+    uint64_t repeats = 0; /* Times the line in last_ops has been seen */
+    bool ok = true;
+
+    while (ok && buf_stack) {
+        char *line = readline();
+        if (!line)
+            continue;
+        int argc;
+        char **argv = parse_args(line, &argc);
+        if (argc == 0)
+            continue;
+        if (!find_cmd(argv[0])) {
+            report(1, "Unknown command '%s'", argv[0]);
+            ok = false;
+            break;
+        }
+        if (strcmp(argv[0], "source") == 0 && argc >= 2) {
+            if (!push_file(argv[1])) {
+                report(1, "Could not open source file '%s'", argv[1]);
+                ok = false;
+            }
+            continue;
+        }
+
+        line_ops.len = 0;
+        bytes_put_varint(&line_ops, intern(&strs, argv[0]));
+        bytes_put_varint(&line_ops, argc);
+        for (int i = 1; i < argc; i++)
+            bytes_put_varint(&line_ops, intern(&strs, argv[i]));
+
+        if (repeats && line_ops.len == last_ops.len &&
+            memcmp(line_ops.data, last_ops.data, line_ops.len) == 0) {
+            repeats++;
+            continue;
+        }
+        if (repeats) {
+            bytes_put_varint(&recs, repeats);
+            bytes_append(&recs, last_ops.data, last_ops.len);
+            h.nrecords++;
+        }
+        bytes_t t = last_ops;
+        last_ops = line_ops;
+        line_ops = t;
+        repeats = 1;
+    }
+    if (repeats) {
+        bytes_put_varint(&recs, repeats);
+        bytes_append(&recs, last_ops.data, last_ops.len);
+        h.nrecords++;
+    }
+    while (buf_stack)
+        pop_file();
+
+    if (ok) {
+        h.nstrings = strs.cnt;
+        h.strbytes = strs.text.len;
+        FILE *f = fopen(outfile_name, "wb");
+        ok = f && fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(strs.text.data, 1, strs.text.len, f) == strs.text.len &&
+             fwrite(recs.data, 1, recs.len, f) == recs.len;
+        if (f && fclose(f) != 0)
+            ok = false;
+        if (!ok)
+            report(1, "ERROR: Could not write binary trace '%s'",
+                   outfile_name);
+    }
+
+    intern_free(&strs);
+    bytes_free(&recs);
+    bytes_free(&line_ops);
+    bytes_free(&last_ops);
+    return ok;
+}
+
+/*
+ * Run commands of binary trace in file_name.  Each command name is looked up
+ * once, and every record is handed to its command without any parsing.
+ * Return true if the trace is valid and no errors occurred.
+ */
+bool run_binary(char *file_name)
+{
+    save_params();
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        report(1, "ERROR: Could not open binary trace '%s'", file_name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    trace_header_t h;
+    if (len < sizeof(h)) {
+        report(1, "ERROR: Invalid binary trace '%s'", file_name);
+        close(fd);
+        return false;
+    }
+    /* Read-only: commands get private copies of their arguments */
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "ERROR: Could not map binary trace '%s'", file_name);
+        return false;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+    memcpy(&h, map, sizeof(h));
+
+    /* Every string takes at least its terminator */
+    bool valid = memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) == 0 &&
+                 h.strbytes <= len - sizeof(h) && h.nstrings <= h.strbytes;
+    const char **strs = NULL;
+    size_t *lens = NULL;
+    cmd_ptr *ops = NULL;
+    char **argv = NULL;
+    uint32_t *ids = NULL;
+    size_t argv_size = 0;
+    char *args = NULL;
+    size_t args_size = 0;
+
+    if (valid) {
+        /* Find the strings, checking that each ends inside the table */
+        const char *text = map + sizeof(h);
+        size_t pos = 0;
+        strs = malloc_or_fail(((size_t) h.nstrings + 1) * sizeof(char *),
+                              "run_binary");
+        lens = malloc_or_fail(((size_t) h.nstrings + 1) * sizeof(size_t),
+                              "run_binary");
+        for (uint32_t id = 0; valid && id < h.nstrings; id++) {
+            const char *end = memchr(text + pos, '\0', h.strbytes - pos);
+            if (!end) {
+                valid = false;
+                break;
+            }
+            strs[id] = text + pos;
+            lens[id] = end - strs[id] + 1;
+            pos = end - text + 1;
+        }
+        /* Commands are resolved the first time their opcode is seen */
+        ops = calloc_or_fail((size_t) h.nstrings + 1, sizeof(cmd_ptr),
+                             "run_binary");
+    }
+
+    size_t pos = sizeof(h) + h.strbytes;
+    for (uint64_t r = 0; valid && r < h.nrecords && !quit_flag; r++) {
+        uint64_t count, op, argc, id;
+        if (!get_varint(map, len, &pos, &count) ||
+            !get_varint(map, len, &pos, &op) ||
+            !get_varint(map, len, &pos, &argc) || op >= h.nstrings ||
+            argc == 0 || argc - 1 > len - pos || argc > INT_MAX) {
+            valid = false;
+            break;
+        }
+
+        if (argc > argv_size) {
+            if (argv) {
+                free_array(argv, argv_size, sizeof(char *));
+                free_array(ids, argv_size, sizeof(uint32_t));
+            }
+            argv_size = 2 * argc;
+            argv = malloc_or_fail(argv_size * sizeof(char *), "run_binary");
+            ids = malloc_or_fail(argv_size * sizeof(uint32_t), "run_binary");
+        }
+        ids[0] = op;
+        size_t bytes = lens[op];
+        for (uint64_t i = 1; valid && i < argc; i++) {
+            valid = get_varint(map, len, &pos, &id) && id < h.nstrings;
+            if (valid) {
+                ids[i] = id;
+                bytes += lens[id];
+            }
+        }
+        if (!valid)
+            break;
+        if (bytes > args_size) {
+            if (args)
+                free_array(args, args_size, sizeof(char));
+            args_size = 2 * bytes;
+            args = malloc_or_fail(args_size, "run_binary");
+        }
+
+        if (!ops[op])
+            ops[op] = find_cmd(strs[op]);
+        for (uint64_t c = 0; c < count && !quit_flag; c++) {
+            /* Like a parsed line, each run gets arguments it may modify */
+            char *p = args;
+            for (uint64_t i = 0; i < argc; i++) {
+                memcpy(p, strs[ids[i]], lens[ids[i]]);
+                argv[i] = p;
+                p += lens[ids[i]];
+            }
+            if (echo) {
+                report_noreturn(1, prompt);
+                for (uint64_t i = 0; i < argc; i++)
+                    report_noreturn(1, i + 1 < argc ? "%s " : "%s\n",
+                                    argv[i]);
+            }
+            if (ops[op])
+                run_cmd(ops[op], argc, argv);
+            else
+                interpret_cmda(argc, argv);
+        }
+    }
+
+    if (!valid)
+        report(1, "ERROR: Invalid binary trace '%s'", file_name);
+
+    if (strs) {
+        free_array(strs, (size_t) h.nstrings + 1, sizeof(char *));
+        free_array(lens, (size_t) h.nstrings + 1, sizeof(size_t));
+    }
+    if (ops)
+        free_array(ops, (size_t) h.nstrings + 1, sizeof(cmd_ptr));
+    if (argv) {
+        free_array(argv, argv_size, sizeof(char *));
+        free_array(ids, argv_size, sizeof(uint32_t));
+    }
+    if (args)
+        free_array(args, args_size, sizeof(char));
+    munmap(map, len);
+    return valid && err_cnt == 0;
+}
@@ -1,12 +1,13 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 
 /* Implementation of simple command-line interface */
 
 /* Simulation flag of console option */
-extern bool simulation;
+extern int simulation;
 
 /* Each command defined in terms of a function */
 typedef bool (*cmd_function)(int argc, char *argv[]);
@@ -19,6 +20,7 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    struct LATENCY *latency; /* Allocated once the command is timed */
     cmd_ptr next;
 };
 
@@ -33,6 +35,7 @@ struct PELE {
     char *documentation;
     /* Function that gets called whenever parameter changes */
     setter_function setter;
+    int reset_val; /* Value when commands started, restored by reset */
     param_ptr next;
 };
 
@@ -51,9 +54,24 @@ void add_param(char *name,
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Extract 64-bit integer from text and store at loc */
+bool get_int64(char *vname, int64_t *loc);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
+/* Add function to be executed by the reset command */
+void add_reset_helper(cmd_function rf);
+
+/* Function run with the name of each command just before executing it */
+typedef void (*cmd_hook_function)(char *name);
+
+/* Set function run before each command, or NULL for none */
+void set_cmd_hook(cmd_hook_function hook);
+
+/* Set function run after each command that doesn't quit, or NULL for none */
+void set_cmd_done_hook(cmd_hook_function hook);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -76,4 +94,12 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/* Compile commands from infile_name, or stdin if NULL, into binary trace.
+ * Return true if successful.
+ */
+bool compile_trace(char *infile_name, char *outfile_name);
+
+/* Run commands of binary trace.  Return true if no errors occurred */
+bool run_binary(char *file_name);
+
 #endif /* LAB0_CONSOLE_H */
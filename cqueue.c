@@ -0,0 +1,316 @@
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+
+/* Keep data written by different threads on different cache lines */
+#define CACHE_LINE 64
+
+/* Hazard pointers per thread: the node being read and its successor */
+#define HP_PER_THREAD 2
+
+/* Linked queue node */
+typedef struct NODE {
+    void *item;
+    _Atomic(struct NODE *) next;
+} node_t;
+
+/* Per-thread reclamation state of a CQ_MS queue */
+typedef struct {
+    alignas(CACHE_LINE) _Atomic(node_t *) hazard[HP_PER_THREAD];
+    node_t **retired; /* Dequeued nodes that may still be read by others */
+    size_t nretired;
+} hp_rec_t;
+
+struct CQUEUE {
+    int kind;
+    /* CQ_RING */
+    void **slots;
+    size_t mask;
+    alignas(CACHE_LINE) atomic_size_t head; /* Next slot to read */
+    size_t tail_cache;                      /* Consumer's copy of tail */
+    alignas(CACHE_LINE) atomic_size_t tail; /* Next slot to write */
+    size_t head_cache;                      /* Producer's copy of head */
+    /* CQ_MS */
+    alignas(CACHE_LINE) _Atomic(node_t *) first; /* Dummy node before head */
+    alignas(CACHE_LINE) _Atomic(node_t *) last;
+    hp_rec_t *hp;
+    int nthreads;
+    size_t retire_limit; /* Scan hazard pointers once this many retired */
+};
+
+/* Zeroed allocation aligned to a cache line */
+static void *alloc_aligned(size_t size)
+{
+    size = (size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+    void *p = aligned_alloc(CACHE_LINE, size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+static node_t *node_new(void *item)
+{
+    node_t *n = malloc(sizeof(node_t));
+    if (!n)
+        return NULL;
+    n->item = item;
+    atomic_init(&n->next, NULL);
+    return n;
+}
+
+/*
+ * Create empty concurrent queue of given kind.
+ * Return NULL if arguments are invalid or could not allocate space.
+ */
+cq_t *cq_new(int kind, size_t capacity, int nthreads)
+{
+    if (kind != CQ_RING && kind != CQ_MS)
+        return NULL;
+    if (kind == CQ_RING ? capacity == 0 || capacity > SIZE_MAX / 2
+                        : nthreads <= 0)
+        return NULL;
+
+    cq_t *cq = alloc_aligned(sizeof(cq_t));
+    if (!cq)
+        return NULL;
+    cq->kind = kind;
+
+    if (kind == CQ_RING) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        cq->slots = malloc(size * sizeof(void *));
+        if (!cq->slots) {
+            free(cq);
+            return NULL;
+        }
+        cq->mask = size - 1;
+        atomic_init(&cq->head, 0);
+        atomic_init(&cq->tail, 0);
+        return cq;
+    }
+
+    cq->nthreads = nthreads;
+    /* Leaves at least half of each scan's nodes free to reclaim */
+    cq->retire_limit = 2 * HP_PER_THREAD * (size_t) nthreads;
+    cq->hp = alloc_aligned(nthreads * sizeof(hp_rec_t));
+    node_t *dummy = node_new(NULL);
+    if (!cq->hp || !dummy)
+        goto fail;
+    atomic_init(&cq->first, dummy);
+    atomic_init(&cq->last, dummy);
+    for (int i = 0; i < nthreads; i++) {
+        cq->hp[i].retired = malloc(cq->retire_limit * sizeof(node_t *));
+        if (!cq->hp[i].retired)
+            goto fail;
+    }
+    return cq;
+
+fail:
+    if (cq->hp) {
+        for (int i = 0; i < nthreads; i++)
+            free(cq->hp[i].retired);
+    }
+    free(cq->hp);
+    free(dummy);
+    free(cq);
+    return NULL;
+}
+
+/*
+ * Free all storage used by queue, including nodes still queued.
+ * No effect if cq is NULL
+ */
+void cq_free(cq_t *cq)
+{
+    if (!cq)
+        return;
+
+    if (cq->kind == CQ_RING) {
+        free(cq->slots);
+        free(cq);
+        return;
+    }
+
+    node_t *n = atomic_load(&cq->first);
+    while (n) {
+        node_t *next = atomic_load(&n->next);
+        free(n);
+        n = next;
+    }
+    for (int i = 0; i < cq->nthreads; i++) {
+        for (size_t j = 0; j < cq->hp[i].nretired; j++)
+            free(cq->hp[i].retired[j]);
+        free(cq->hp[i].retired);
+    }
+    free(cq->hp);
+    free(cq);
+}
+
+static bool ring_enqueue(cq_t *cq, void *item)
+{
+    size_t tail = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+    if (tail - cq->head_cache > cq->mask) {
+        cq->head_cache = atomic_load_explicit(&cq->head, memory_order_acquire);
+        if (tail - cq->head_cache > cq->mask)
+            return false;
+    }
+    cq->slots[tail & cq->mask] = item;
+    atomic_store_explicit(&cq->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_dequeue(cq_t *cq, void **itemp)
+{
+    size_t head = atomic_load_explicit(&cq->head, memory_order_relaxed);
+    if (head == cq->tail_cache) {
+        cq->tail_cache = atomic_load_explicit(&cq->tail, memory_order_acquire);
+        if (head == cq->tail_cache)
+            return false;
+    }
+    *itemp = cq->slots[head & cq->mask];
+    atomic_store_explicit(&cq->head, head + 1, memory_order_release);
+    return true;
+}
+
+/*
+ * Publish p as hazard pointer i of thread tid, and check that it is still
+ * the value of src, so that whoever unlinks it afterwards sees the hazard.
+ */
+static bool protect(cq_t *cq,
+                    int tid,
+                    int i,
+                    node_t *p,
+                    _Atomic(node_t *) *src)
+{
+    atomic_store(&cq->hp[tid].hazard[i], p);
+    return atomic_load(src) == p;
+}
+
+static void clear_hazards(cq_t *cq, int tid)
+{
+    for (int i = 0; i < HP_PER_THREAD; i++)
+        atomic_store_explicit(&cq->hp[tid].hazard[i], NULL,
+                              memory_order_release);
+}
+
+static bool is_hazard(cq_t *cq, node_t *n)
+{
+    for (int t = 0; t < cq->nthreads; t++) {
+        for (int i = 0; i < HP_PER_THREAD; i++) {
+            if (atomic_load(&cq->hp[t].hazard[i]) == n)
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Queue node n for freeing once no thread holds a hazard pointer to it.
+ * Scanning is deferred until the retired list is full, and each scan
+ * frees all but at most nthreads * HP_PER_THREAD nodes.
+ */
+static void retire(cq_t *cq, int tid, node_t *n)
+{
+    hp_rec_t *rec = &cq->hp[tid];
+    rec->retired[rec->nretired++] = n;
+    if (rec->nretired < cq->retire_limit)
+        return;
+
+    size_t kept = 0;
+    for (size_t j = 0; j < rec->nretired; j++) {
+        if (is_hazard(cq, rec->retired[j]))
+            rec->retired[kept++] = rec->retired[j];
+        else
+            free(rec->retired[j]);
+    }
+    rec->nretired = kept;
+}
+
+static bool ms_enqueue(cq_t *cq, int tid, void *item)
+{
+    node_t *n = node_new(item);
+    if (!n)
+        return false;
+
+    for (;;) {
+        node_t *last = atomic_load(&cq->last);
+        if (!protect(cq, tid, 0, last, &cq->last))
+            continue;
+        node_t *next = atomic_load(&last->next);
+        if (last != atomic_load(&cq->last))
+            continue;
+        if (next) {
+            /* Tail is lagging behind; help move it along */
+            atomic_compare_exchange_weak(&cq->last, &last, next);
+            continue;
+        }
+        node_t *expected = NULL;
+        if (atomic_compare_exchange_weak(&last->next, &expected, n)) {
+            atomic_compare_exchange_strong(&cq->last, &last, n);
+            break;
+        }
+    }
+    clear_hazards(cq, tid);
+    return true;
+}
+
+static bool ms_dequeue(cq_t *cq, int tid, void **itemp)
+{
+    node_t *first;
+    for (;;) {
+        first = atomic_load(&cq->first);
+        if (!protect(cq, tid, 0, first, &cq->first))
+            continue;
+        node_t *last = atomic_load(&cq->last);
+        node_t *next = atomic_load(&first->next);
+        /* first is protected, and while it is still the dummy its next
+         * link is fixed, so next cannot have been retired either.
+         */
+        if (!protect(cq, tid, 1, next, &first->next) ||
+            first != atomic_load(&cq->first))
+            continue;
+        if (!next) {
+            clear_hazards(cq, tid);
+            return false;
+        }
+        if (first == last) {
+            atomic_compare_exchange_weak(&cq->last, &last, next);
+            continue;
+        }
+        /* Read before the swing, after which next may be dequeued */
+        void *item = next->item;
+        if (atomic_compare_exchange_weak(&cq->first, &first, next)) {
+            *itemp = item;
+            break;
+        }
+    }
+    clear_hazards(cq, tid);
+    /* The old dummy is unreachable now; next becomes the dummy */
+    retire(cq, tid, first);
+    return true;
+}
+
+/*
+ * Attempt to append item at tail of queue on behalf of thread tid.
+ * Return false if the ring is full or could not allocate space.
+ */
+bool cq_enqueue(cq_t *cq, int tid, void *item)
+{
+    return cq->kind == CQ_RING ? ring_enqueue(cq, item)
+                               : ms_enqueue(cq, tid, item);
+}
+
+/*
+ * Attempt to remove item from head of queue on behalf of thread tid.
+ * Return true and store the item in *itemp if successful.
+ */
+bool cq_dequeue(cq_t *cq, int tid, void **itemp)
+{
+    return cq->kind == CQ_RING ? ring_dequeue(cq, itemp)
+                               : ms_dequeue(cq, tid, itemp);
+}
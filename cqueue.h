@@ -0,0 +1,61 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/*
+ * Concurrent queues of opaque pointers, for producer/consumer use.
+ *
+ * Two variants are provided:
+ *  - CQ_RING: a bounded lock-free ring for exactly one producer thread and
+ *    one consumer thread.
+ *  - CQ_MS: an unbounded lock-free linked queue after Michael and Scott,
+ *    for any number of producers and consumers.  Dequeued nodes are
+ *    reclaimed with hazard pointers.
+ *
+ * Every thread using a CQ_MS queue passes its own thread index, between 0
+ * and the nthreads given to cq_new, to cq_enqueue and cq_dequeue.  The
+ * index is ignored by CQ_RING queues.
+ *
+ * Unlike queue_t, these queues allocate with the system allocator, since
+ * the allocator in harness.c is not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Queue variants for cq_new */
+enum {
+    CQ_RING, /* Single producer, single consumer ring */
+    CQ_MS,   /* Multi-producer, multi-consumer linked queue */
+};
+
+typedef struct CQUEUE cq_t;
+
+/*
+ * Create empty concurrent queue of given kind.
+ * A CQ_RING queue holds up to capacity items, rounded up to a power of 2.
+ * A CQ_MS queue may be used by up to nthreads threads.
+ * Return NULL if arguments are invalid or could not allocate space.
+ */
+cq_t *cq_new(int kind, size_t capacity, int nthreads);
+
+/*
+ * Free all storage used by queue, including nodes still queued.
+ * Must not be called while other threads use the queue.
+ * No effect if cq is NULL
+ */
+void cq_free(cq_t *cq);
+
+/*
+ * Attempt to append item at tail of queue on behalf of thread tid.
+ * Return false if the ring is full or could not allocate space.
+ */
+bool cq_enqueue(cq_t *cq, int tid, void *item);
+
+/*
+ * Attempt to remove item from head of queue on behalf of thread tid.
+ * Return true and store the item in *itemp if successful.
+ * Return false if queue is empty.
+ */
+bool cq_dequeue(cq_t *cq, int tid, void **itemp);
+
+#endif /* LAB0_CQUEUE_H */
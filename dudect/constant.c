@@ -22,7 +22,6 @@ const int drop_size = 20;
 static queue_t *q = NULL;
 static char random_string[NR_MEASURE][8];
 static int random_string_iter = 0;
-enum { test_insert_tail, test_size };
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -38,7 +37,7 @@ char *get_random_string(void)
 
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
-    randombytes(input_data, number_measurements * chunk_size);
+    prng_fill(input_data, number_measurements * chunk_size);
     for (size_t i = 0; i < number_measurements; i++) {
         classes[i] = randombit();
         if (classes[i] == 0)
@@ -47,39 +46,170 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 
     for (size_t i = 0; i < NR_MEASURE; ++i) {
         /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
+        prng_fill((uint8_t *) random_string[i], 7);
         random_string[i][7] = 0;
     }
 }
 
+/* String inserted by the measured operation */
+static char *dut_str;
+
+/*
+ * One extra element is inserted at one end and removed from it again, so
+ * that the queue code, the end element and the next free block are as warm
+ * for an empty queue as after a long setup.
+ */
+static void fill_queue(size_t n, bool at_tail)
+{
+    dut_new();
+    if (at_tail) {
+        dut_insert_tail(get_random_string(), n + 1);
+        q_remove_tail(q, NULL, 0);
+    } else {
+        dut_insert_head(get_random_string(), n + 1);
+        q_remove_head(q, NULL, 0);
+    }
+}
+
+static void setup_queue(size_t n)
+{
+    fill_queue(n, false);
+}
+
+static void setup_insert_head(size_t n)
+{
+    dut_str = get_random_string();
+    fill_queue(n, false);
+}
+
+static void setup_insert_tail(size_t n)
+{
+    dut_str = get_random_string();
+    fill_queue(n, true);
+}
+
+/* Removal always has an element to take */
+static void setup_remove(size_t n)
+{
+    setup_queue(n + 1);
+}
+
+/* Sorting needs distinct strings, or it can finish early */
+static void setup_sort(size_t n)
+{
+    char s[8];
+    dut_new();
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < sizeof(s) - 1; j++)
+            s[j] = 'a' + prng_below(26);
+        s[sizeof(s) - 1] = '\0';
+        q_insert_head(q, s);
+    }
+}
+
+static void run_insert_head(void)
+{
+    dut_insert_head(dut_str, 1);
+}
+
+static void run_insert_tail(void)
+{
+    dut_insert_tail(dut_str, 1);
+}
+
+static void run_remove_head(void)
+{
+    q_remove_head(q, NULL, 0);
+}
+
+static void run_size(void)
+{
+    dut_size(1);
+}
+
+static void run_reverse(void)
+{
+    q_reverse(q);
+}
+
+static void run_sort(void)
+{
+    q_sort(q);
+}
+
+/*
+ * Insertion sort of the strings of the queue, a quadratic reference that
+ * complexity has to tell apart from sort.
+ */
+static void run_isort(void)
+{
+    size_t n = q_size(q);
+    char **strs = malloc((n + 1) * sizeof(char *));
+    if (!strs)
+        return;
+    for (size_t i = 0; i < n; i++) {
+        char *s = q_pop_head(q);
+        size_t j = i;
+        for (; j > 0 && strcmp(strs[j - 1], s) > 0; j--)
+            strs[j] = strs[j - 1];
+        strs[j] = s;
+    }
+    for (size_t i = 0; i < n; i++) {
+        q_insert_tail(q, strs[i]);
+        q_release(strs[i]);
+    }
+    free(strs);
+}
+
+const dut_op_t dut_ops[] = {
+    {"ih", setup_insert_head, run_insert_head},
+    {"it", setup_insert_tail, run_insert_tail},
+    {"rh", setup_remove, run_remove_head},
+    {"size", setup_queue, run_size},
+    {"reverse", setup_queue, run_reverse},
+    {"sort", setup_sort, run_sort},
+    {"isort", setup_sort, run_isort},
+    {NULL, NULL, NULL},
+};
+
+const dut_op_t *dut_find_op(const char *name)
+{
+    for (const dut_op_t *op = dut_ops; op->name; op++) {
+        if (strcmp(op->name, name) == 0)
+            return op;
+    }
+    return NULL;
+}
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
-             int mode)
-{
-    assert(mode == test_insert_tail || mode == test_size);
-    if (mode == test_insert_tail) {
-        for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-    } else {
-        for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+             const dut_op_t *op)
+{
+    /*
+     * A long setup evicts the harness's own data, so the operation is read
+     * and the ticks are kept in registers until the second tick is taken.
+     * Otherwise the bigger queues of the random class would be charged for
+     * those misses.
+     */
+    void (*run)(void) = op->run;
+    for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
+        op->setup(*(uint16_t *) (input_data + i * chunk_size) % 10000);
+        int64_t before = cpucycles();
+        run();
+        int64_t after = cpucycles();
+        before_ticks[i] = before;
+        after_ticks[i] = after;
+        dut_free();
     }
 }
+
+int64_t measure_once(const dut_op_t *op, size_t n)
+{
+    op->setup(n);
+    int64_t before = cpucycles();
+    op->run();
+    int64_t after = cpucycles();
+    dut_free();
+    return after - before;
+}
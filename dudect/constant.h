@@ -1,6 +1,7 @@
 #ifndef DUDECT_CONSTANT_H
 #define DUDECT_CONSTANT_H
 
+#include <stddef.h>
 #include <stdint.h>
 #define dut_new() ((void) (q = q_new()))
 
@@ -26,11 +27,31 @@
 
 #define dut_free() ((void) (q_free(q)))
 
+/*
+ * Queue operation that can be measured.  setup creates a queue for a
+ * measurement that starts from n elements, and run performs the operation
+ * once on it, so that only run is timed.
+ */
+typedef struct {
+    const char *name; /* Name of the qtest command, or of a reference */
+    void (*setup)(size_t n);
+    void (*run)(void);
+} dut_op_t;
+
+/* Operations that can be measured, ending with one whose name is NULL */
+extern const dut_op_t dut_ops[];
+
+/* Find operation by name, or return NULL */
+const dut_op_t *dut_find_op(const char *name);
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
-             int mode);
+             const dut_op_t *op);
+
+/* Cycles taken by one run of op on a queue of n elements */
+int64_t measure_once(const dut_op_t *op, size_t n);
 
 #endif
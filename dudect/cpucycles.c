@@ -0,0 +1,67 @@
+#include "cpucycles.h"
+#include <asm/unistd.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+cpucycles_backend_t cpucycles_backend =
+    CPUCYCLES_HAVE_COUNTER ? CPUCYCLES_COUNTER : CPUCYCLES_CLOCK;
+int cpucycles_perf_fd = -1;
+
+static const char *backend_names[CPUCYCLES_NR_BACKENDS] = {
+    "auto", "counter", "perf cycles", "perf instructions", "clock",
+};
+
+const char *cpucycles_name(cpucycles_backend_t b)
+{
+    if (b < 0 || b >= CPUCYCLES_NR_BACKENDS)
+        return "unknown";
+    return backend_names[b];
+}
+
+int cpucycles_perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+bool cpucycles_select(cpucycles_backend_t b)
+{
+    if (b == CPUCYCLES_AUTO)
+        b = CPUCYCLES_HAVE_COUNTER ? CPUCYCLES_COUNTER : CPUCYCLES_CLOCK;
+
+    int fd = -1;
+    switch (b) {
+    case CPUCYCLES_COUNTER:
+        if (!CPUCYCLES_HAVE_COUNTER)
+            return false;
+        break;
+    case CPUCYCLES_PERF_CYCLES:
+    case CPUCYCLES_PERF_INSTRS:
+        fd = cpucycles_perf_open(b == CPUCYCLES_PERF_CYCLES
+                                     ? PERF_COUNT_HW_CPU_CYCLES
+                                     : PERF_COUNT_HW_INSTRUCTIONS);
+        if (fd < 0)
+            return false;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        break;
+    case CPUCYCLES_CLOCK:
+        break;
+    default:
+        return false;
+    }
+
+    if (cpucycles_perf_fd >= 0)
+        close(cpucycles_perf_fd);
+    cpucycles_perf_fd = fd;
+    cpucycles_backend = b;
+    return true;
+}
@@ -1,12 +1,86 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
+#include <stdbool.h>
 #include <stdint.h>
-// http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+#include <time.h>
+#include <unistd.h>
+
+/* Sources of timestamps, selectable at runtime */
+typedef enum {
+    CPUCYCLES_AUTO,         /* Counter register if any, else clock */
+    CPUCYCLES_COUNTER,      /* rdtscp/lfence on x86, cntvct_el0 on ARM */
+    CPUCYCLES_PERF_CYCLES,  /* perf_event_open hardware cycle counter */
+    CPUCYCLES_PERF_INSTRS,  /* perf_event_open retired instructions */
+    CPUCYCLES_CLOCK,        /* clock_gettime(CLOCK_MONOTONIC) nanoseconds */
+    CPUCYCLES_NR_BACKENDS,
+} cpucycles_backend_t;
+
+/* Backend in use.  Only change it through cpucycles_select */
+extern cpucycles_backend_t cpucycles_backend;
+/* Counter opened by the perf backends, or -1 */
+extern int cpucycles_perf_fd;
+
+/* Switch to backend b.  Return false, keeping the old one, if unavailable */
+bool cpucycles_select(cpucycles_backend_t b);
+
+/* Name of backend b */
+const char *cpucycles_name(cpucycles_backend_t b);
+
+/*
+ * Open a perf counter of hardware event config (PERF_COUNT_HW_*) for this
+ * thread, counting events in user mode from now, or return -1.
+ */
+int cpucycles_perf_open(uint64_t config);
+
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+#define CPUCYCLES_HAVE_COUNTER 1
+#else
+#define CPUCYCLES_HAVE_COUNTER 0
+#endif
+
+/*
+ * Counter register read, ordered against the code being timed.  On x86
+ * rdtscp waits for earlier instructions to finish and the lfence keeps later
+ * ones from starting first.  The ARM generic timer ticks at a fixed rate well
+ * below the core clock, after an isb to serialize.
+ * http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
+ */
+static inline int64_t cpucycles_counter(void)
 {
 #if defined(__i386__) || defined(__x86_64__)
-    unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
     return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
+    return (int64_t) val;
 #else
-#error Unsupported Architecture
+    return 0;
 #endif
 }
+
+static inline int64_t cpucycles(void)
+{
+    switch (cpucycles_backend) {
+    case CPUCYCLES_PERF_CYCLES:
+    case CPUCYCLES_PERF_INSTRS: {
+        /* A system call per sample, which the t-test sees as equal noise */
+        int64_t val;
+        if (read(cpucycles_perf_fd, &val, sizeof(val)) == sizeof(val))
+            return val;
+        return 0;
+    }
+    case CPUCYCLES_CLOCK: {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    default:
+        return cpucycles_counter();
+    }
+}
+
+#endif
@@ -4,8 +4,21 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-bool is_insert_tail_const(void);
-bool is_size_const(void);
+/* Interface to test if operation is constant time */
+bool is_op_const(const dut_op_t *op);
+
+/* Complexity classes, simplest first */
+typedef enum {
+    COMPLEXITY_CONST,
+    COMPLEXITY_LOG,
+    COMPLEXITY_LINEAR,
+    COMPLEXITY_NLOGN,
+    COMPLEXITY_QUADRATIC,
+} complexity_t;
+
+const char *complexity_name(complexity_t c);
+
+/* Time op on growing queues and return the class that fits best */
+complexity_t measure_complexity(const dut_op_t *op);
 
 #endif
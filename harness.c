@@ -2,11 +2,15 @@
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -30,23 +34,117 @@
 /* Data structures used by our code */
 
 /*
- * Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+ * Header placed in front of every allocated block.
+ * The next field links the block into its pool's free list once freed.
  */
 typedef struct BELE {
-    struct BELE *next, *prev;
+    struct BELE *next;
     size_t payload_size;
+    struct SLAB *slab;   /* Slab the block was carved from */
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    unsigned char payload[0] __attribute__((aligned(16)));
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
+/*
+ * Small blocks are carved out of slabs, one size class per slab, so that
+ * most calls to test_malloc and test_free never reach the system allocator.
+ * Class slabs are SLAB_SIZE bytes and aligned to SLAB_SIZE, so the slab of
+ * a block is found by masking its address.
+ * A block larger than the biggest class gets a slab of its own.
+ */
+#define SLAB_SIZE (64 * 1024)
+#define NR_CLASSES 8
+#define LARGE_CLASS NR_CLASSES
+static const size_t class_size[NR_CLASSES] = {16,  32,  48,  64,
+                                              96, 128, 192, 256};
+
+/* Enough bits to mark every block of the smallest class as live */
+#define SLAB_MAP_WORDS (SLAB_SIZE / 64 / 64)
+
+typedef struct SLAB {
+    struct SLAB *next, *prev;
+    struct POOL *pool;
+    size_t size_class;
+    size_t block_size; /* Distance between consecutive blocks */
+    size_t nr_blocks;  /* Capacity of the slab */
+    size_t used;       /* Number of blocks carved so far */
+    size_t live;       /* Number of blocks currently allocated */
+    uint64_t live_map[SLAB_MAP_WORDS];
+    unsigned char blocks[0] __attribute__((aligned(16)));
+} slab_t;
+
+/*
+ * A pool owns a set of slabs and recycles the blocks freed from them.
+ * Releasing a pool hands all of its slabs back at once.
+ */
+struct POOL {
+    slab_t *slabs;
+    slab_t *current[NR_CLASSES];        /* Slab being carved, per class */
+    block_ele_t *free_list[NR_CLASSES]; /* Recycled blocks, per class */
+};
+
+/* Pool for blocks not requested through test_pool_malloc */
+static struct POOL default_pool;
+
+/*
+ * Registry of live slabs, as an open-addressing hash table keyed by slab
+ * address.  Together with the per-slab live map, it tells in O(1) whether
+ * a pointer is a currently allocated block.
+ */
+static slab_t **slab_table = NULL;
+static size_t slab_table_bits = 0;
+static size_t slab_table_cnt = 0;
+
+/* Class slabs kept around for reuse instead of being returned to system */
+#define MAX_SPARE_SLABS 16
+static slab_t *spare_slabs = NULL;
+static size_t spare_cnt = 0;
+
 static size_t allocated_count = 0;
 
+/*
+ * Light mode: only one block in LIGHT_SAMPLE is filled when allocated or
+ * freed, and footers of freed blocks are checked in batches.  Freed blocks
+ * wait in a quarantine, unavailable for reuse, until it fills up, a pool is
+ * released, or error_check runs at the end of a command.
+ */
+int light_mode = 0;
+#define LIGHT_SAMPLE 16
+#define QUARANTINE_SIZE 1024
+static block_ele_t *quarantine[QUARANTINE_SIZE];
+static size_t quarantine_cnt = 0;
+static size_t light_tick = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/*
+ * Allocation profile.  Counts are always kept; time spent in the allocator
+ * is only measured while memprof is nonzero.
+ * Request sizes are counted in power-of-2 buckets: bucket k holds sizes
+ * up to 2^k, above those of bucket k - 1.
+ */
+int memprof = 0;
+#define PROF_BUCKETS 40
+#define PROF_CMDS 64
+
+typedef struct {
+    char *name;
+    size_t calls, allocs, frees;
+} cmd_prof_t;
+
+static struct {
+    size_t hist[PROF_BUCKETS];
+    size_t allocs, frees, fails;
+    size_t live_bytes, peak_bytes; /* Payload bytes allocated */
+    size_t sys_bytes, peak_sys;    /* Slab memory taken from the system */
+    uint64_t ns;                   /* Time spent in allocator calls */
+    cmd_prof_t cmds[PROF_CMDS];
+    size_t ncmds;
+    cmd_prof_t *cmd; /* Command running now */
+} prof;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -68,13 +166,175 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (fail_probability <= 0 ||
+        prng_below(100) >= (uint64_t) fail_probability)
+        return false;
+    prof.fails++;
+    return true;
+}
+
+/* Start timing an allocator call */
+static uint64_t prof_enter()
+{
+    return memprof ? now_ns() : 0;
+}
+
+static void prof_leave(uint64_t start)
+{
+    if (memprof)
+        prof.ns += now_ns() - start;
+}
+
+static void prof_sys(size_t bytes, bool taken)
+{
+    if (!taken) {
+        prof.sys_bytes -= bytes;
+        return;
+    }
+    prof.sys_bytes += bytes;
+    if (prof.sys_bytes > prof.peak_sys)
+        prof.peak_sys = prof.sys_bytes;
+}
+
+static void prof_alloc(size_t size)
+{
+    size_t k = size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+    prof.hist[k < PROF_BUCKETS ? k : PROF_BUCKETS - 1]++;
+    prof.allocs++;
+    prof.live_bytes += size;
+    if (prof.live_bytes > prof.peak_bytes)
+        prof.peak_bytes = prof.live_bytes;
+    if (prof.cmd)
+        prof.cmd->allocs++;
+}
+
+static void prof_free(size_t size)
+{
+    prof.frees++;
+    prof.live_bytes -= size;
+    if (prof.cmd)
+        prof.cmd->frees++;
+}
+
+/* Home position of slab address in registry */
+static size_t slab_hash(uintptr_t addr)
+{
+    return (size_t) ((addr * 0x9E3779B97F4A7C15ULL) >> (64 - slab_table_bits));
+}
+
+/* Find registered slab starting at addr, or NULL if there is none */
+static slab_t *slab_lookup(uintptr_t addr)
+{
+    if (!slab_table)
+        return NULL;
+
+    size_t mask = ((size_t) 1 << slab_table_bits) - 1;
+    for (size_t i = slab_hash(addr);; i = (i + 1) & mask) {
+        slab_t *slab = slab_table[i];
+        if (!slab || (uintptr_t) slab == addr)
+            return slab;
+    }
+}
+
+static void slab_table_insert(slab_t *slab);
+
+/* Double registry size, keeping load factor at most one half */
+static bool slab_table_grow()
+{
+    slab_t **old_table = slab_table;
+    size_t old_size = old_table ? (size_t) 1 << slab_table_bits : 0;
+    size_t bits = old_table ? slab_table_bits + 1 : 10;
+    slab_t **table = calloc((size_t) 1 << bits, sizeof(slab_t *));
+    if (!table)
+        return false;
+
+    slab_table = table;
+    slab_table_bits = bits;
+    slab_table_cnt = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_table[i])
+            slab_table_insert(old_table[i]);
+    }
+    free(old_table);
+    return true;
+}
+
+static void slab_table_insert(slab_t *slab)
+{
+    size_t mask = ((size_t) 1 << slab_table_bits) - 1;
+    size_t i = slab_hash((uintptr_t) slab);
+    while (slab_table[i])
+        i = (i + 1) & mask;
+    slab_table[i] = slab;
+    slab_table_cnt++;
+}
+
+/* Remove slab from registry, shifting back entries of its probe chain */
+static void slab_table_remove(slab_t *slab)
+{
+    size_t mask = ((size_t) 1 << slab_table_bits) - 1;
+    size_t i = slab_hash((uintptr_t) slab);
+    while (slab_table[i] != slab)
+        i = (i + 1) & mask;
+
+    for (size_t j = (i + 1) & mask; slab_table[j]; j = (j + 1) & mask) {
+        size_t home = slab_hash((uintptr_t) slab_table[j]);
+        /* Entry at j may fill the hole at i unless its home is in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slab_table[i] = slab_table[j];
+            i = j;
+        }
+    }
+    slab_table[i] = NULL;
+    slab_table_cnt--;
+}
+
+/* Index of block b within its class slab */
+static size_t slab_index(slab_t *slab, block_ele_t *b)
+{
+    return ((unsigned char *) b - slab->blocks) / slab->block_size;
+}
+
+static void mark_live(slab_t *slab, block_ele_t *b, bool live)
+{
+    if (slab->size_class == LARGE_CLASS) {
+        slab->live = live;
+        return;
+    }
+
+    size_t i = slab_index(slab, b);
+    if (live) {
+        slab->live_map[i / 64] |= (uint64_t) 1 << (i % 64);
+        slab->live++;
+    } else {
+        slab->live_map[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        slab->live--;
+    }
+}
+
+/* Is b the header of a block that is currently allocated? */
+static bool is_allocated(block_ele_t *b)
+{
+    /* Blocks of a class slab */
+    uintptr_t addr = (uintptr_t) b;
+    slab_t *slab = slab_lookup(addr & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (slab && slab->size_class != LARGE_CLASS &&
+        addr >= (uintptr_t) slab->blocks) {
+        size_t offset = addr - (uintptr_t) slab->blocks;
+        size_t i = offset / slab->block_size;
+        if (offset % slab->block_size == 0 && i < slab->used)
+            return slab->live_map[i / 64] & ((uint64_t) 1 << (i % 64));
+    }
+
+    /* Block that has a slab of its own */
+    slab = slab_lookup(addr - offsetof(slab_t, blocks));
+    return slab && slab->size_class == LARGE_CLASS;
 }
 
 /*
  * Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Signal error if doesn't seem like legitimate block.
+ * Return NULL if cautious mode shows the block is not allocated at all.
  */
 static block_ele_t *find_header(void *p)
 {
@@ -86,17 +346,12 @@ static block_ele_t *find_header(void *p)
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!is_allocated(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            return NULL;
         }
     }
 
@@ -119,48 +374,177 @@ static size_t *find_footer(block_ele_t *b)
     return p;
 }
 
-/*
- * Implementation of application functions
- */
-void *test_malloc(size_t size)
+/* Smallest size class holding size bytes, or LARGE_CLASS if none */
+static size_t find_class(size_t size)
 {
-    if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to malloc disallowed");
-        return NULL;
+    for (size_t c = 0; c < NR_CLASSES; c++) {
+        if (size <= class_size[c])
+            return c;
     }
+    return LARGE_CLASS;
+}
 
-    if (fail_allocation()) {
-        report_event(MSG_WARN, "Malloc returning NULL");
+/* Round up block size so that payloads stay 16-byte aligned */
+static size_t block_stride(size_t size)
+{
+    return (sizeof(block_ele_t) + size + sizeof(size_t) + 15) & ~(size_t) 15;
+}
+
+/* Allocate a slab from system memory and add it to the pool */
+static slab_t *slab_new(struct POOL *pool, size_t size_class, size_t size)
+{
+    if (2 * (slab_table_cnt + 1) > ((size_t) 1 << slab_table_bits) &&
+        !slab_table_grow()) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
+    size_t block_size = block_stride(size);
+    size_t bytes;
+    slab_t *slab;
+    if (size_class == LARGE_CLASS) {
+        bytes = sizeof(slab_t) + block_size;
+        slab = malloc(bytes);
+        if (slab)
+            prof_sys(bytes, true);
+    } else if (spare_slabs) {
+        bytes = SLAB_SIZE;
+        slab = spare_slabs;
+        spare_slabs = slab->next;
+        spare_cnt--;
+    } else {
+        bytes = SLAB_SIZE;
+        slab = aligned_alloc(SLAB_SIZE, bytes);
+        if (slab)
+            prof_sys(bytes, true);
+    }
+    if (!slab) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
+    slab->pool = pool;
+    slab->size_class = size_class;
+    slab->block_size = block_size;
+    slab->nr_blocks = (bytes - sizeof(slab_t)) / block_size;
+    slab->used = 0;
+    slab->live = 0;
+    memset(slab->live_map, 0, sizeof(slab->live_map));
+    slab->prev = NULL;
+    slab->next = pool->slabs;
+    if (pool->slabs)
+        pool->slabs->prev = slab;
+    pool->slabs = slab;
+    slab_table_insert(slab);
+    return slab;
+}
+
+/* Unlink slab from its pool and return it to system memory */
+static void slab_free(slab_t *slab)
+{
+    struct POOL *pool = slab->pool;
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        pool->slabs = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab_table_remove(slab);
+    if (slab->size_class != LARGE_CLASS && spare_cnt < MAX_SPARE_SLABS) {
+        slab->next = spare_slabs;
+        spare_slabs = slab;
+        spare_cnt++;
+        return;
+    }
+    prof_sys(slab->size_class == LARGE_CLASS
+                 ? sizeof(slab_t) + slab->block_size
+                 : SLAB_SIZE,
+             false);
+    free(slab);
+}
+
+/* Take a block able to hold size bytes from pool */
+static block_ele_t *pool_get_block(struct POOL *pool, size_t size)
+{
+    size_t c = find_class(size);
+    if (c == LARGE_CLASS) {
+        slab_t *slab = slab_new(pool, c, size);
+        if (!slab)
+            return NULL;
+        slab->used = 1;
+        block_ele_t *b = (block_ele_t *) slab->blocks;
+        b->slab = slab;
+        return b;
+    }
+
+    block_ele_t *b = pool->free_list[c];
+    if (b) {
+        pool->free_list[c] = b->next;
+        return b;
+    }
+
+    slab_t *slab = pool->current[c];
+    if (!slab || slab->used == slab->nr_blocks) {
+        slab = slab_new(pool, c, class_size[c]);
+        if (!slab)
+            return NULL;
+        pool->current[c] = slab;
+    }
+    b = (block_ele_t *) (slab->blocks + slab->used++ * slab->block_size);
+    b->slab = slab;
+    return b;
+}
+
+/* Mark fresh block as allocated and return its payload */
+static void *init_block(block_ele_t *new_block, size_t size)
+{
     new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    if (!light_mode || ++light_tick % LIGHT_SAMPLE == 0)
+        memset(p, FILLCHAR, size);
+    new_block->next = NULL;
+    mark_live(new_block->slab, new_block, true);
     allocated_count++;
+    prof_alloc(size);
 
     return p;
 }
 
+/* Shared by test_malloc and test_pool_malloc */
+static void *pool_malloc(struct POOL *pool, size_t size)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return NULL;
+    }
+
+    block_ele_t *new_block = pool_get_block(pool, size);
+    if (!new_block)
+        return NULL;
+
+    return init_block(new_block, size);
+}
+
+/*
+ * Implementation of application functions
+ */
+void *test_malloc(size_t size)
+{
+    uint64_t start = prof_enter();
+    void *p = pool_malloc(&default_pool, size);
+    prof_leave(start);
+    return p;
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -173,7 +557,40 @@ void *test_calloc(size_t nelem, size_t elsize)
     return ptr;
 }
 
-void test_free(void *p)
+/* Hand freed block back for reuse */
+static void recycle_block(block_ele_t *b)
+{
+    slab_t *slab = b->slab;
+    if (slab->size_class == LARGE_CLASS) {
+        slab_free(slab);
+    } else {
+        /* Recycle block within its pool */
+        struct POOL *pool = slab->pool;
+        b->next = pool->free_list[slab->size_class];
+        pool->free_list[slab->size_class] = b;
+    }
+}
+
+/* Check footers of the blocks freed in light mode, then recycle them */
+static void flush_quarantine()
+{
+    for (size_t i = 0; i < quarantine_cnt; i++) {
+        block_ele_t *b = quarantine[i];
+        if (*find_footer(b) != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p "
+                         "after freeing it",
+                         (void *) &b->payload);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+        recycle_block(b);
+    }
+    quarantine_cnt = 0;
+}
+
+/* Shared by test_free and the pool functions */
+static void release_block(void *p)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
@@ -184,6 +601,22 @@ void test_free(void *p)
         return;
 
     block_ele_t *b = find_header(p);
+    if (!b)
+        return;
+    b->magic_header = MAGICFREE;
+    allocated_count--;
+    mark_live(b->slab, b, false);
+    prof_free(b->payload_size);
+
+    if (light_mode) {
+        if (++light_tick % LIGHT_SAMPLE == 0)
+            memset(p, FILLCHAR, b->payload_size);
+        if (quarantine_cnt == QUARANTINE_SIZE)
+            flush_quarantine();
+        quarantine[quarantine_cnt++] = b;
+        return;
+    }
+
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -192,22 +625,16 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
-    b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
+    recycle_block(b);
+}
 
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
-    allocated_count--;
+void test_free(void *p)
+{
+    uint64_t start = prof_enter();
+    release_block(p);
+    prof_leave(start);
 }
 
 // cppcheck-suppress unusedFunction
@@ -221,11 +648,230 @@ char *test_strdup(const char *s)
     return (char *) memcpy(new, s, len);
 }
 
+static bool pool_malloc_n(struct POOL *pool,
+                          const size_t *sizes,
+                          void **ptrs,
+                          size_t n)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return false;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        block_ele_t *b = pool_get_block(pool, sizes[i]);
+        if (!b) {
+            while (i > 0)
+                release_block(ptrs[--i]);
+            return false;
+        }
+        ptrs[i] = init_block(b, sizes[i]);
+    }
+    return true;
+}
+
+/* Verify footer of a block released along with its pool, and count it */
+static void check_released(block_ele_t *b)
+{
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "releasing its pool",
+                     (void *) &b->payload);
+        error_occurred = true;
+    }
+    prof_free(b->payload_size);
+}
+
+bool test_pool_malloc_n(struct POOL *pool,
+                        const size_t *sizes,
+                        void **ptrs,
+                        size_t n)
+{
+    uint64_t start = prof_enter();
+    bool ok = pool_malloc_n(pool, sizes, ptrs, n);
+    prof_leave(start);
+    return ok;
+}
+
+struct POOL *test_pool_new()
+{
+    struct POOL *pool = test_malloc(sizeof(struct POOL));
+    if (pool)
+        memset(pool, 0, sizeof(struct POOL));
+    return pool;
+}
+
+void *test_pool_malloc(struct POOL *pool, size_t size)
+{
+    uint64_t start = prof_enter();
+    void *p = pool_malloc(pool, size);
+    prof_leave(start);
+    return p;
+}
+
+static void pool_release(struct POOL *pool)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return;
+    }
+
+    if (!pool)
+        return;
+
+    /* Quarantined blocks may belong to the slabs about to go */
+    flush_quarantine();
+
+    /* Check the blocks still live in each slab, then drop whole slabs */
+    while (pool->slabs) {
+        slab_t *slab = pool->slabs;
+        if (slab->size_class == LARGE_CLASS)
+            check_released((block_ele_t *) slab->blocks);
+        for (size_t w = 0; w < SLAB_MAP_WORDS && slab->live; w++) {
+            for (uint64_t m = slab->live_map[w]; m; m &= m - 1) {
+                size_t i = w * 64 + __builtin_ctzll(m);
+                check_released(
+                    (block_ele_t *) (slab->blocks + i * slab->block_size));
+            }
+        }
+        allocated_count -= slab->live;
+        slab_free(slab);
+    }
+
+    release_block(pool);
+}
+
+void test_pool_release(struct POOL *pool)
+{
+    uint64_t start = prof_enter();
+    pool_release(pool);
+    prof_leave(start);
+}
+
 size_t allocation_check()
 {
     return allocated_count;
 }
 
+size_t allocation_bytes()
+{
+    return prof.live_bytes;
+}
+
+/*
+ * Start afresh for another run of commands: run deferred checks, clear the
+ * allocation profile and pending errors, and restore the checking modes.
+ */
+void harness_reset()
+{
+    flush_quarantine();
+    size_t live = prof.live_bytes, sys = prof.sys_bytes;
+    memset(&prof, 0, sizeof(prof));
+    prof.live_bytes = prof.peak_bytes = live;
+    prof.sys_bytes = prof.peak_sys = sys;
+    light_tick = 0;
+    cautious_mode = true;
+    noallocate_mode = false;
+    error_occurred = false;
+    error_message = "";
+}
+
+/* Attribute allocations from now on to command name */
+void memprof_command(char *name)
+{
+    cmd_prof_t *c = prof.cmds;
+    while (c < prof.cmds + prof.ncmds && c->name != name)
+        c++;
+    if (c == prof.cmds + PROF_CMDS) {
+        prof.cmd = NULL;
+        return;
+    }
+    if (c == prof.cmds + prof.ncmds) {
+        c->name = name;
+        prof.ncmds++;
+    }
+    c->calls++;
+    prof.cmd = c;
+}
+
+/* Display allocation profile */
+void memstat_show(int vlevel)
+{
+    report(vlevel, "Allocations %lu (%lu failed), frees %lu",
+           (unsigned long) prof.allocs, (unsigned long) prof.fails,
+           (unsigned long) prof.frees);
+    report(vlevel, "Payload bytes %lu, peak %lu",
+           (unsigned long) prof.live_bytes, (unsigned long) prof.peak_bytes);
+    report(vlevel, "System bytes %lu, peak %lu", (unsigned long) prof.sys_bytes,
+           (unsigned long) prof.peak_sys);
+    if (memprof)
+        report(vlevel, "Time in allocator %.6f s", prof.ns * 1e-9);
+
+    report(vlevel, "Request sizes:");
+    for (size_t k = 0; k < PROF_BUCKETS; k++) {
+        if (prof.hist[k])
+            report(vlevel, "  <= %-10lu %lu", 1UL << k,
+                   (unsigned long) prof.hist[k]);
+    }
+
+    report(vlevel, "By command:");
+    for (size_t i = 0; i < prof.ncmds; i++) {
+        cmd_prof_t *c = &prof.cmds[i];
+        if (c->allocs || c->frees)
+            report(vlevel, "  %-10s %lu calls, %lu allocations, %lu frees",
+                   c->name, (unsigned long) c->calls,
+                   (unsigned long) c->allocs, (unsigned long) c->frees);
+    }
+}
+
+/*
+ * Write allocation profile to file_name as a JSON object.
+ * Return true if successful.
+ */
+bool memstat_export(char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+
+    fprintf(f,
+            "{\"allocs\": %lu, \"fails\": %lu, \"frees\": %lu, "
+            "\"live_bytes\": %lu, \"peak_bytes\": %lu, "
+            "\"system_bytes\": %lu, \"peak_system_bytes\": %lu, "
+            "\"alloc_seconds\": %.6f,\n \"sizes\": {",
+            (unsigned long) prof.allocs, (unsigned long) prof.fails,
+            (unsigned long) prof.frees, (unsigned long) prof.live_bytes,
+            (unsigned long) prof.peak_bytes, (unsigned long) prof.sys_bytes,
+            (unsigned long) prof.peak_sys, prof.ns * 1e-9);
+    const char *sep = "";
+    for (size_t k = 0; k < PROF_BUCKETS; k++) {
+        if (prof.hist[k]) {
+            fprintf(f, "%s\"%lu\": %lu", sep, 1UL << k,
+                    (unsigned long) prof.hist[k]);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "},\n \"commands\": {");
+    sep = "";
+    for (size_t i = 0; i < prof.ncmds; i++) {
+        cmd_prof_t *c = &prof.cmds[i];
+        fprintf(f,
+                "%s\"%s\": {\"calls\": %lu, \"allocs\": %lu, "
+                "\"frees\": %lu}",
+                sep, c->name, (unsigned long) c->calls,
+                (unsigned long) c->allocs, (unsigned long) c->frees);
+        sep = ", ";
+    }
+    fprintf(f, "}}\n");
+    return fclose(f) == 0;
+}
+
 /*
  * Implementation of functions for testing
  */
@@ -253,6 +899,8 @@ void set_noallocate_mode(bool noallocate)
  */
 bool error_check()
 {
+    /* Run deferred checks first, so that they count for this command */
+    flush_quarantine();
     bool e = error_occurred;
     error_occurred = false;
     return e;
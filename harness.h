@@ -17,14 +17,62 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/*
+ * Allocation pools.
+ * Blocks taken from a pool are checked like any other block and may be
+ * freed one at a time with test_free.  Releasing the pool frees whatever
+ * blocks remain in it, a whole slab at a time.
+ */
+struct POOL;
+struct POOL *test_pool_new();
+void *test_pool_malloc(struct POOL *pool, size_t size);
+
+/*
+ * Allocate n blocks from pool, of sizes[i] bytes each, into ptrs.
+ * Counts as a single allocation: either all blocks are allocated,
+ * or none are and false is returned.
+ */
+bool test_pool_malloc_n(struct POOL *pool,
+                        const size_t *sizes,
+                        void **ptrs,
+                        size_t n);
+void test_pool_release(struct POOL *pool);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report payload bytes currently allocated */
+size_t allocation_bytes();
+
+/* Clear profile and errors, ready for another run of commands */
+void harness_reset();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Nonzero to sample payload fills and defer footer checks of freed blocks
+ * until the next error_check or pool release
+ */
+extern int light_mode;
+
+/* Nonzero to measure time spent in allocator calls */
+extern int memprof;
+
+/* Attribute allocations from now on to command name */
+void memprof_command(char *name);
+
+/* Display allocation profile */
+void memstat_show(int vlevel);
+
+/*
+ * Write allocation profile to file_name as a JSON object.
+ * Return true if successful.
+ */
+bool memstat_export(char *file_name);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
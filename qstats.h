@@ -0,0 +1,82 @@
+#ifndef LAB0_QSTATS_H
+#define LAB0_QSTATS_H
+
+/*
+ * Counters on the hot paths of the queue code, for finding out where the
+ * work of a run went.  They are only compiled in when QUEUE_STATS is
+ * defined (make STATS=1), and otherwise cost nothing.  Each thread counts
+ * on its own, and adds its counts to the totals in qstats when flushed.
+ *
+ * Stats builds also fire USDT probes under provider lab0 where
+ * <sys/sdt.h> is available, e.g. for bpftrace -e 'usdt:./qtest:lab0:*'.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t sort_runs;    /* Presorted runs found by sort */
+    uint64_t sort_steps;   /* Merges or partitions done by sort */
+    uint64_t sort_visits;  /* Elements stepped over by those and runs */
+    uint64_t cmp_calls;    /* Element comparisons by sort */
+    uint64_t strcmp_calls; /* Comparisons that called strcmp */
+    uint64_t cmp_long;     /* Comparisons reading past the first 8 bytes */
+    uint64_t bytes_in;     /* String bytes copied by insertions */
+    uint64_t bytes_out;    /* String bytes copied out by removals */
+} qstats_t;
+
+/* Counts flushed so far by all threads, defined by the queue code */
+extern qstats_t qstats;
+
+/* Length of the prefix that cmp_long counts comparisons reading past */
+#define QSTATS_PREFIX 8
+
+#ifdef QUEUE_STATS
+
+extern __thread qstats_t qstats_thread;
+
+#define QSTATS_ENABLED 1
+#define QSTATS_ADD(field, n) (qstats_thread.field += (n))
+
+/* Add the counts of this thread to qstats, and start over */
+static inline void qstats_flush(void)
+{
+    uint64_t *from = (uint64_t *) &qstats_thread, *to = (uint64_t *) &qstats;
+    for (size_t i = 0; i < sizeof(qstats_t) / sizeof(uint64_t); i++) {
+        __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+        from[i] = 0;
+    }
+}
+
+/* Whether comparing a and b reads past their first QSTATS_PREFIX bytes */
+static inline bool qstats_long_cmp(const char *a, const char *b)
+{
+    for (int i = 0; i < QSTATS_PREFIX; i++) {
+        if (a[i] != b[i] || !a[i])
+            return false;
+    }
+    return true;
+}
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QSTATS_PROBE1(name, a) DTRACE_PROBE1(lab0, name, a)
+#endif
+#endif
+
+#else /* QUEUE_STATS */
+
+#define QSTATS_ENABLED 0
+#define QSTATS_ADD(field, n) ((void) 0)
+
+static inline void qstats_flush(void) {}
+
+#endif /* QUEUE_STATS */
+
+#ifndef QSTATS_PROBE1
+#define QSTATS_PROBE1(name, a) ((void) 0)
+#endif
+
+#endif /* LAB0_QSTATS_H */
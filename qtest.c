@@ -1,16 +1,24 @@
 /* Implementation of testing code for queue code */
 
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h> /* strcasecmp */
+#include <strings.h> /* strcasecmp, strncasecmp */
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 
 /* Our program needs to use regular malloc/free */
@@ -26,13 +34,17 @@
 /*
  * It is a bit sketchy to use this #include file on the solution version of the
  * code.
- * OK as long as head field of queue_t structure is in first position in
- * solution code
+ * OK as long as the queue is only inspected through the q_iter_t and q_peek
+ * helpers, which every queue layout provides.
  */
+#include "qstats.h"
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
+#include "random.h"
 #include "report.h"
+#include "snapshot.h"
 
 /* Settable parameters */
 
@@ -52,12 +64,31 @@ static queue_t *q = NULL;
 /* Number of elements in queue */
 static size_t qcnt = 0;
 
+/*
+ * Besides qcnt, commands keep track of what the queue should hold, so that
+ * it can be checked without walking it after every command: the sum of the
+ * hashes of its strings, which ignores their order, and whether it should
+ * be sorted.
+ */
+static uint64_t qhash = 0;
+static bool qsorted = true;
+
+/* Changes of the queue between full checks of it, 0 for checks after sort */
+static int verify_period = 0;
+static int verify_changes = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_QUEUE;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Seed of random strings and allocation failures, 0 for a random seed */
+static int rand_seed = 0;
+
+/* Timestamp source of simulation and complexity, see cpucycles_backend_t */
+static int cycles_backend = CPUCYCLES_AUTO;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -69,13 +100,134 @@ static bool do_free(int argc, char *argv[]);
 static bool do_insert_head(int argc, char *argv[]);
 static bool do_insert_tail(int argc, char *argv[]);
 static bool do_remove_head(int argc, char *argv[]);
+static bool do_remove_tail(int argc, char *argv[]);
 static bool do_remove_head_quiet(int argc, char *argv[]);
 static bool do_reverse(int argc, char *argv[]);
 static bool do_size(int argc, char *argv[]);
 static bool do_sort(int argc, char *argv[]);
 static bool do_show(int argc, char *argv[]);
+static bool do_mt(int argc, char *argv[]);
+static bool do_gen(int argc, char *argv[]);
+static bool do_save(int argc, char *argv[]);
+static bool do_load(int argc, char *argv[]);
+static bool do_memstat(int argc, char *argv[]);
+static bool do_stats(int argc, char *argv[]);
+static bool do_complexity(int argc, char *argv[]);
 
 static void queue_init();
+static bool verify_queue();
+
+static void seed_changed(int oldval)
+{
+    prng_seed((uint32_t) rand_seed);
+}
+
+static void cycles_changed(int oldval)
+{
+    if (cpucycles_select((cpucycles_backend_t) cycles_backend))
+        return;
+    report(1, "Timestamp source %d (%s) not available here", cycles_backend,
+           cpucycles_name((cpucycles_backend_t) cycles_backend));
+    cycles_backend = oldval;
+}
+
+/*
+ * Hardware events of the main thread, sampled around each command while
+ * hwstats is set.  Commands running others, like time, include their events.
+ */
+#define HW_EVENTS 2
+#define HW_CMDS 64
+#define HW_DEPTH 8
+
+static int hw_stats = 0;
+static const char *hw_event_names[HW_EVENTS] = {"cache misses",
+                                                "branch misses"};
+static int hw_fds[HW_EVENTS] = {-1, -1};
+
+typedef struct {
+    char *name;
+    uint64_t calls;
+    uint64_t events[HW_EVENTS];
+} hw_cmd_t;
+
+static hw_cmd_t hw_cmds[HW_CMDS];
+static size_t hw_ncmds = 0;
+
+/* Counter values when each command now running started */
+static uint64_t hw_start[HW_DEPTH][HW_EVENTS];
+static bool hw_start_ok[HW_DEPTH];
+static int hw_depth = 0;
+
+static void hw_close(void)
+{
+    for (int i = 0; i < HW_EVENTS; i++) {
+        if (hw_fds[i] >= 0)
+            close(hw_fds[i]);
+        hw_fds[i] = -1;
+    }
+    hw_depth = 0;
+}
+
+static bool hw_read(uint64_t *vals)
+{
+    for (int i = 0; i < HW_EVENTS; i++) {
+        if (read(hw_fds[i], &vals[i], sizeof(vals[i])) != sizeof(vals[i]))
+            return false;
+    }
+    return true;
+}
+
+static void hwstats_changed(int oldval)
+{
+    static const uint64_t configs[HW_EVENTS] = {PERF_COUNT_HW_CACHE_MISSES,
+                                                PERF_COUNT_HW_BRANCH_MISSES};
+    hw_close();
+    if (!hw_stats)
+        return;
+    for (int i = 0; i < HW_EVENTS; i++) {
+        hw_fds[i] = cpucycles_perf_open(configs[i]);
+        if (hw_fds[i] < 0) {
+            hw_close();
+            report(1, "Hardware counters not available here");
+            hw_stats = 0;
+            return;
+        }
+    }
+}
+
+static void command_started(char *name)
+{
+    memprof_command(name);
+    if (hw_fds[0] < 0)
+        return;
+    if (hw_depth < HW_DEPTH)
+        hw_start_ok[hw_depth] = hw_read(hw_start[hw_depth]);
+    hw_depth++;
+}
+
+static void command_done(char *name)
+{
+    /* Counters may have been opened by this very command */
+    if (hw_depth == 0)
+        return;
+    uint64_t now[HW_EVENTS];
+    if (--hw_depth >= HW_DEPTH || !hw_start_ok[hw_depth] || !hw_read(now))
+        return;
+
+    hw_cmd_t *c = hw_cmds;
+    while (c < hw_cmds + hw_ncmds && c->name != name)
+        c++;
+    if (c == hw_cmds + HW_CMDS)
+        return;
+    if (c == hw_cmds + hw_ncmds) {
+        memset(c, 0, sizeof(*c));
+        c->name = name;
+        hw_ncmds++;
+    }
+    c->calls++;
+    for (int i = 0; i < HW_EVENTS; i++)
+        c->events[i] += now[i] - hw_start[hw_depth][i];
+}
 
 static void console_init()
 {
@@ -90,20 +242,117 @@ static void console_init()
     add_cmd("rh", do_remove_head,
             " [str]          | Remove from head of queue.  Optionally compare "
             "to expected value str");
-    add_cmd(
-        "rhq", do_remove_head_quiet,
-        "                | Remove from head of queue without reporting value.");
+    add_cmd("rt", do_remove_tail,
+            " [str]          | Remove from tail of queue.  Optionally compare "
+            "to expected value str");
+    add_cmd("rhq", do_remove_head_quiet,
+            " [n]            | Remove from head of queue n times without "
+            "reporting values. (default: n == 1)");
     add_cmd("reverse", do_reverse, "                | Reverse queue");
     add_cmd("sort", do_sort, "                | Sort queue in ascending order");
     add_cmd("size", do_size,
             " [n]            | Compute queue size n times (default: n == 1)");
     add_cmd("show", do_show, "                | Show queue contents");
+    add_cmd("mt", do_mt,
+            " p c n [kind]   | Pass n items from p producer to c consumer "
+            "threads through a concurrent queue of kind ms or ring "
+            "(default: ms)");
+    add_cmd("gen", do_gen,
+            " n [key=val]    | Run n operations drawn from a synthetic "
+            "workload: weights ih, it, rh, rt, reverse, sort (default: "
+            "ih=1 it=1 rh=1 rt=1), len=fixed:L|uniform:MIN:MAX|zipf:S:MAX, "
+            "dup=percent of repeated keys, phases=number of throughput "
+            "reports");
+    add_cmd("save", do_save,
+            " [file]         | Save queue contents to snapshot file "
+            "(default: a temporary file of this process)");
+    add_cmd("load", do_load,
+            " [file]         | Insert strings of snapshot file at tail of "
+            "queue (default: the file of save without one)");
+    add_cmd("complexity", do_complexity,
+            " op [class]     | Estimate complexity class of op over growing "
+            "queues.  Optionally compare to expected class, e.g. O(n log n)");
+    add_cmd("memstat", do_memstat,
+            " [file]         | Show allocation profile, or save it to file "
+            "as JSON");
+    add_cmd("stats", do_stats,
+            " [reset]        | Show counters of queue operations and "
+            "hardware events, or clear them");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("light", &light_mode,
+              "Sample block fills and batch footer checks (0: check all)",
+              NULL);
+    add_param("memprof", &memprof, "Time allocator calls for memstat", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("sortalgo", &sort_algo,
+              "Sorting engine (0: merge sort, 1: prefix-keyed merge sort)",
+              NULL);
+    add_param("sortthreads", &sort_threads, "Number of threads used by sort",
+              NULL);
+    add_param("seed", &rand_seed, "Random seed (0: seed from /dev/urandom)",
+              seed_changed);
+    add_param("cycles", &cycles_backend,
+              "Timestamp source (0: auto, 1: counter register, 2: perf "
+              "cycles, 3: perf instructions, 4: clock_gettime)",
+              cycles_changed);
+    add_param("verify", &verify_period,
+              "Check whole queue every N changes, and on exit (0: after "
+              "every sort)",
+              NULL);
+    add_param("hwstats", &hw_stats,
+              "Sample cache and branch misses of each command",
+              hwstats_changed);
+}
+
+static uint64_t str_hash(const char *s)
+{
+    /* FNV-1a, finished off so that sums of hashes mix all bits */
+    uint64_t h = 0xcbf29ce484222325;
+    for (; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 0x100000001b3;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+
+static void shadow_reset()
+{
+    qhash = 0;
+    qsorted = true;
+    verify_changes = 0;
+}
+
+/* Note that s has been inserted */
+static void shadow_insert(const char *s)
+{
+    qhash += str_hash(s);
+    qsorted = false;
+}
+
+/* Note that a string with hash h has been removed */
+static void shadow_remove(uint64_t h)
+{
+    qhash -= h;
+}
+
+/*
+ * Called at the end of each command that changed the queue.
+ * Return false if this was the change to make a full check on, and it
+ * failed.
+ */
+static bool verify_change()
+{
+    if (verify_period <= 0 || ++verify_changes < verify_period)
+        return true;
+    verify_changes = 0;
+    return verify_queue();
 }
 
 static bool do_new(int argc, char *argv[])
@@ -124,6 +373,7 @@ static bool do_new(int argc, char *argv[])
         q = q_new();
     exception_cancel();
     qcnt = 0;
+    shadow_reset();
     show_queue(3);
 
     return ok && !error_check();
@@ -139,9 +389,14 @@ static bool do_free(int argc, char *argv[])
     bool ok = true;
     if (!q)
         report(3, "Warning: Calling free on null queue");
+    /* Changes since the last full check, or a sort, are checked before
+     * they are lost
+     */
+    if (verify_changes > 0 || qsorted)
+        ok = verify_queue();
     error_check();
 
-    if (qcnt > big_queue_size)
+    if (qcnt > (size_t) big_queue_size)
         set_cautious_mode(false);
     if (exception_setup(true))
         q_free(q);
@@ -150,6 +405,7 @@ static bool do_free(int argc, char *argv[])
 
     q = NULL;
     qcnt = 0;
+    shadow_reset();
     show_queue(3);
 
     size_t bcnt = allocation_check();
@@ -167,21 +423,86 @@ static bool do_free(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t len = MIN_RANDSTR_LEN + prng_below(buf_size - MIN_RANDSTR_LEN);
 
     for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+        buf[n] = charset[prng_below(sizeof charset - 1)];
     }
     buf[len] = '\0';
 }
 
+/* Number of strings handed to the bulk insertion API at a time */
+#define BULK_BATCH 1024
+
+/*
+ * Insert cnt strings with q_insert_head_bulk or q_insert_tail_bulk, all or
+ * nothing, counting a failure as one.  what names the strings in reports.
+ */
+static bool insert_batch(bool at_tail, char **strs, size_t cnt, char *what)
+{
+    bool ok = true;
+    bool rval = at_tail ? q_insert_tail_bulk(q, strs, cnt)
+                        : q_insert_head_bulk(q, strs, cnt);
+    if (rval) {
+        qcnt += cnt;
+        for (size_t i = 0; i < cnt; i++)
+            shadow_insert(strs[i]);
+        /* The string inserted last ends up at the end inserted into */
+        char *last = strs[cnt - 1];
+        char *value = at_tail ? q_peek_tail(q) : q_peek_head(q);
+        if (strcmp(value, last)) {
+            report(1, "ERROR: Failed to save copy of string in list");
+            ok = false;
+        } else if (value == last) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new "
+                   "list element");
+            ok = false;
+        }
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %s failed", what);
+        else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   what, fail_count);
+            ok = false;
+        }
+    }
+    return ok && !error_check();
+}
+
+/*
+ * Insert reps copies of str, or random strings if str equals RAND, in
+ * batches of BULK_BATCH.
+ */
+static bool insert_bulk(bool at_tail, char *str, int64_t reps)
+{
+    static char randstr_bufs[BULK_BATCH][MAX_RANDSTR_LEN];
+    char *strs[BULK_BATCH];
+    bool need_rand = !strcmp(str, "RAND");
+    bool ok = true;
+
+    for (int64_t r = 0; ok && r < reps; r += BULK_BATCH) {
+        size_t cnt = reps - r < BULK_BATCH ? reps - r : BULK_BATCH;
+        for (size_t i = 0; i < cnt; i++) {
+            if (need_rand) {
+                fill_rand_string(randstr_bufs[i], MAX_RANDSTR_LEN);
+                strs[i] = randstr_bufs[i];
+            } else {
+                strs[i] = str;
+            }
+        }
+        ok = insert_batch(at_tail, strs, cnt, str);
+    }
+    return ok;
+}
+
 static bool do_insert_head(int argc, char *argv[])
 {
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
-    int reps = 1;
+    int64_t reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
@@ -190,7 +511,7 @@ static bool do_insert_head(int argc, char *argv[])
 
     char *inserts = argv[1];
     if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
+        if (!get_int64(argv[2], &reps)) {
             report(1, "Invalid number of insertions '%s'", argv[2]);
             return false;
         }
@@ -205,30 +526,40 @@ static bool do_insert_head(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    if (reps > 1 && !fail_probability) {
+        /* Allocations can't fail, so hand the whole run to the bulk API */
+        if (exception_setup(true))
+            ok = insert_bulk(false, argv[1], reps);
+        exception_cancel();
+        show_queue(3);
+        return ok && verify_change();
+    }
+
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        for (int64_t r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_head(q, inserts);
             if (rval) {
                 qcnt++;
-                if (!q->head->value) {
+                shadow_insert(inserts);
+                if (strcmp(q_peek_head(q), inserts)) {
                     report(1, "ERROR: Failed to save copy of string in list");
                     ok = false;
-                } else if (r == 0 && inserts == q->head->value) {
+                } else if (r == 0 && inserts == q_peek_head(q)) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "list element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == q->head->value) {
+                } else if (r == 1 && lasts == q_peek_head(q)) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "list element");
                     ok = false;
                     break;
                 }
-                lasts = q->head->value;
+                lasts = q_peek_head(q);
             } else {
                 fail_count++;
                 if (fail_count < fail_limit)
@@ -246,7 +577,7 @@ static bool do_insert_head(int argc, char *argv[])
     exception_cancel();
 
     show_queue(3);
-    return ok;
+    return ok && verify_change();
 }
 
 static bool do_insert_tail(int argc, char *argv[])
@@ -256,7 +587,7 @@ static bool do_insert_tail(int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok = is_insert_tail_const();
+        bool ok = is_op_const(dut_find_op("it"));
         if (!ok) {
             report(1, "ERROR: Probably not constant time");
             return false;
@@ -266,7 +597,7 @@ static bool do_insert_tail(int argc, char *argv[])
     }
 
     char randstr_buf[MAX_RANDSTR_LEN];
-    int reps = 1;
+    int64_t reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
@@ -275,7 +606,7 @@ static bool do_insert_tail(int argc, char *argv[])
 
     char *inserts = argv[1];
     if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
+        if (!get_int64(argv[2], &reps)) {
             report(1, "Invalid number of insertions '%s'", argv[2]);
             return false;
         }
@@ -290,14 +621,24 @@ static bool do_insert_tail(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (reps > 1 && !fail_probability) {
+        /* Allocations can't fail, so hand the whole run to the bulk API */
+        if (exception_setup(true))
+            ok = insert_bulk(true, argv[1], reps);
+        exception_cancel();
+        show_queue(3);
+        return ok && verify_change();
+    }
+
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        for (int64_t r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_tail(q, inserts);
             if (rval) {
                 qcnt++;
-                if (!q->head->value) {
+                shadow_insert(inserts);
+                if (strcmp(q_peek_tail(q), inserts)) {
                     report(1, "ERROR: Failed to save copy of string in list");
                     ok = false;
                 }
@@ -317,11 +658,14 @@ static bool do_insert_tail(int argc, char *argv[])
     }
     exception_cancel();
     show_queue(3);
-    return ok;
+    return ok && verify_change();
 }
 
-static bool do_remove_head(int argc, char *argv[])
+/* Shared by rh and rt, which differ in the end of queue they remove from */
+static bool do_remove(bool from_tail, int argc, char *argv[])
 {
+    char *end = from_tail ? "tail" : "head";
+
     if (argc != 1 && argc != 2) {
         report(1, "%s needs 0-1 arguments", argv[0]);
         return false;
@@ -354,14 +698,22 @@ static bool do_remove_head(int argc, char *argv[])
     removes[string_length + STRINGPAD] = '\0';
 
     if (!q)
-        report(3, "Warning: Calling remove head on null queue");
-    else if (!q->head)
-        report(3, "Warning: Calling remove head on empty queue");
+        report(3, "Warning: Calling remove %s on null queue", end);
+    else if (!q_peek_head(q))
+        report(3, "Warning: Calling remove %s on empty queue", end);
     error_check();
 
+    /* The removed string may be truncated, so hash it while still queued */
+    char *victim = from_tail ? q_peek_tail(q) : q_peek_head(q);
+    uint64_t victim_hash = victim ? str_hash(victim) : 0;
+
     bool rval = false;
-    if (exception_setup(true))
-        rval = q_remove_head(q, removes, string_length + 1);
+    if (exception_setup(true)) {
+        if (from_tail)
+            rval = q_remove_tail(q, removes, string_length + 1);
+        else
+            rval = q_remove_head(q, removes, string_length + 1);
+    }
     exception_cancel();
 
     if (rval) {
@@ -380,13 +732,15 @@ static bool do_remove_head(int argc, char *argv[])
             i++;
         if (i != string_length + STRINGPAD) {
             report(1,
-                   "ERROR: copying of string in remove_head overflowed "
-                   "destination buffer.");
+                   "ERROR: copying of string in remove_%s overflowed "
+                   "destination buffer.",
+                   end);
             ok = false;
         } else {
             report(2, "Removed %s from queue", removes);
         }
         qcnt--;
+        shadow_remove(victim_hash);
     } else {
         fail_count++;
         if (!check && fail_count < fail_limit) {
@@ -408,31 +762,55 @@ static bool do_remove_head(int argc, char *argv[])
 
     free(removes);
     free(checks);
-    return ok && !error_check();
+    return ok && !error_check() && verify_change();
+}
+
+static bool do_remove_head(int argc, char *argv[])
+{
+    return do_remove(false, argc, argv);
+}
+
+static bool do_remove_tail(int argc, char *argv[])
+{
+    return do_remove(true, argc, argv);
 }
 
 static bool do_remove_head_quiet(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int64_t reps = 1;
+    if (argc == 2 && !get_int64(argv[1], &reps)) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
         return false;
     }
 
     bool ok = true;
     if (!q)
         report(3, "Warning: Calling remove head on null queue");
-    else if (!q->head)
+    else if (!q_peek_head(q))
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
-    bool rval = false;
-    if (exception_setup(true))
-        rval = q_remove_head(q, NULL, 0);
+    /* Strings are handed over rather than copied, then dropped */
+    int64_t removed = 0;
+    if (exception_setup(true)) {
+        for (; removed < reps; removed++) {
+            char *s = q_pop_head(q);
+            if (!s)
+                break;
+            shadow_remove(str_hash(s));
+            q_release(s);
+        }
+    }
     exception_cancel();
+    qcnt -= removed;
 
-    if (rval) {
-        report(2, "Removed element from queue");
-        qcnt--;
+    if (removed == reps) {
+        report(2, "Removed %" PRId64 " element(s) from queue", removed);
     } else {
         fail_count++;
         if (fail_count < fail_limit)
@@ -444,7 +822,7 @@ static bool do_remove_head_quiet(int argc, char *argv[])
     }
 
     show_queue(3);
-    return ok && !error_check();
+    return ok && !error_check() && verify_change();
 }
 
 static bool do_reverse(int argc, char *argv[])
@@ -462,10 +840,12 @@ static bool do_reverse(int argc, char *argv[])
     if (exception_setup(true))
         q_reverse(q);
     exception_cancel();
+    if (qcnt > 1)
+        qsorted = false;
 
     set_noallocate_mode(false);
     show_queue(3);
-    return !error_check();
+    return !error_check() && verify_change();
 }
 
 static bool do_size(int argc, char *argv[])
@@ -475,7 +855,7 @@ static bool do_size(int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok = is_size_const();
+        bool ok = is_op_const(dut_find_op("size"));
         if (!ok) {
             report(1, "ERROR: Probably not constant time");
             return false;
@@ -489,7 +869,7 @@ static bool do_size(int argc, char *argv[])
         return false;
     }
 
-    int reps = 1;
+    int64_t reps = 1;
     bool ok = true;
     if (argc != 1 && argc != 2) {
         report(1, "%s needs 0-1 arguments", argv[0]);
@@ -497,18 +877,18 @@ static bool do_size(int argc, char *argv[])
     }
 
     if (argc == 2) {
-        if (!get_int(argv[1], &reps)) {
-            report(1, "Invalid number of calls to size '%s'", argv[2]);
+        if (!get_int64(argv[1], &reps)) {
+            report(1, "Invalid number of calls to size '%s'", argv[1]);
         }
     }
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!q)
         report(3, "Warning: Calling size on null queue");
     error_check();
 
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        for (int64_t r = 0; ok && r < reps; r++) {
             cnt = q_size(q);
             ok = ok && !error_check();
         }
@@ -517,11 +897,12 @@ static bool do_size(int argc, char *argv[])
 
     if (ok) {
         if (qcnt == cnt) {
-            report(2, "Queue size = %d", cnt);
+            report(2, "Queue size = %zu", cnt);
         } else {
             report(1,
-                   "ERROR: Computed queue size as %d, but correct value is %d",
-                   cnt, (int) qcnt);
+                   "ERROR: Computed queue size as %zu, but correct value is "
+                   "%zu",
+                   cnt, qcnt);
             ok = false;
         }
     }
@@ -542,7 +923,7 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on null queue");
     error_check();
 
-    int cnt = q_size(q);
+    size_t cnt = q_size(q);
     if (cnt < 2)
         report(3, "Warning: Calling sort on single node");
     error_check();
@@ -554,41 +935,749 @@ bool do_sort(int argc, char *argv[])
     set_noallocate_mode(false);
 
     bool ok = true;
-    if (q) {
-        for (list_ele_t *e = q->head; e && --cnt; e = e->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            if (strcasecmp(e->value, e->next->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
+    qsorted = true;
+    if (!q) {
+        /* Nothing to check */
+    } else if (verify_period <= 0) {
+        ok = verify_queue();
+    } else {
+        /* Only look at the ends, until the next full check */
+        char *head = q_peek_head(q), *tail = q_peek_tail(q);
+        if (head && tail && strcasecmp(head, tail) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            ok = false;
+        }
+        ok = ok && verify_change();
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Most threads the mt command will start */
+#define MT_MAX_THREADS 64
+
+/* Capacity of the ring used by the mt command */
+#define MT_RING_SIZE 1024
+
+/* Latency samples kept by each consumer thread of the mt command */
+#define MT_SAMPLES 4096
+
+/* State of one mt thread */
+typedef struct {
+    cq_t *cq;
+    int tid;
+    long ops;                      /* Items to produce */
+    long count;                    /* Items consumed */
+    size_t stride;                 /* Sample every stride-th item */
+    uint64_t samples[MT_SAMPLES];  /* Latencies in ns */
+    size_t nsamples;
+    uint64_t max_latency;
+} mt_worker_t;
+
+/* Set to make all mt threads give up */
+static atomic_bool mt_stop;
+static atomic_int mt_producers_left;
+
+/* Each item carries the time it was enqueued */
+static void *mt_producer(void *arg)
+{
+    mt_worker_t *w = arg;
+    for (long i = 0; i < w->ops; i++) {
+        while (!cq_enqueue(w->cq, w->tid, (void *) (uintptr_t) now_ns())) {
+            if (atomic_load_explicit(&mt_stop, memory_order_relaxed))
+                goto done;
+            /* Full ring: let the consumer run, in case it shares the CPU */
+            sched_yield();
+        }
+    }
+done:
+    atomic_fetch_sub(&mt_producers_left, 1);
+    return NULL;
+}
+
+static void *mt_consumer(void *arg)
+{
+    mt_worker_t *w = arg;
+    while (!atomic_load_explicit(&mt_stop, memory_order_relaxed)) {
+        /* Checked first: once all producers are done, empty means finished */
+        bool last = atomic_load(&mt_producers_left) == 0;
+        void *item;
+        if (!cq_dequeue(w->cq, w->tid, &item)) {
+            if (last)
                 break;
+            sched_yield();
+            continue;
+        }
+
+        uint64_t latency = now_ns() - (uintptr_t) item;
+        if (latency > w->max_latency)
+            w->max_latency = latency;
+        if (w->count++ % w->stride == 0 && w->nsamples < MT_SAMPLES)
+            w->samples[w->nsamples++] = latency;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static bool do_mt(int argc, char *argv[])
+{
+    if (argc != 4 && argc != 5) {
+        report(1, "%s takes 3-4 arguments", argv[0]);
+        return false;
+    }
+
+    int producers, consumers, ops;
+    if (!get_int(argv[1], &producers) || !get_int(argv[2], &consumers) ||
+        !get_int(argv[3], &ops) || producers < 1 || consumers < 1 ||
+        ops < 1 || producers + consumers > MT_MAX_THREADS) {
+        report(1, "Invalid thread or item counts");
+        return false;
+    }
+
+    int kind = CQ_MS;
+    if (argc == 5) {
+        if (!strcmp(argv[4], "ring"))
+            kind = CQ_RING;
+        else if (strcmp(argv[4], "ms")) {
+            report(1, "Unknown queue kind '%s'", argv[4]);
+            return false;
+        }
+    }
+    if (kind == CQ_RING && (producers != 1 || consumers != 1)) {
+        report(1, "A ring takes one producer and one consumer");
+        return false;
+    }
+
+    int nthreads = producers + consumers;
+    cq_t *cq = cq_new(kind, MT_RING_SIZE, nthreads);
+    if (!cq) {
+        report(1, "ERROR: Could not create concurrent queue");
+        return false;
+    }
+    mt_worker_t *workers =
+        calloc_or_fail(nthreads, sizeof(mt_worker_t), "do_mt");
+    pthread_t threads[MT_MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].cq = cq;
+        workers[i].tid = i;
+        /* Spread the remainder over the first producers */
+        if (i < producers)
+            workers[i].ops = ops / producers + (i < ops % producers);
+        workers[i].stride = ops / ((size_t) consumers * MT_SAMPLES) + 1;
+    }
+    atomic_store(&mt_stop, false);
+    atomic_store(&mt_producers_left, producers);
+
+    /* The time limit alarm must interrupt this thread, not a worker */
+    sigset_t alarm_set, old_set;
+    sigemptyset(&alarm_set);
+    sigaddset(&alarm_set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm_set, &old_set);
+
+    bool ok = true;
+    int started = 0;
+    double elapsed;
+    init_time(&elapsed);
+    for (; started < nthreads; started++) {
+        void *(*fn)(void *) = started < producers ? mt_producer : mt_consumer;
+        if (pthread_create(&threads[started], NULL, fn, &workers[started])) {
+            report(1, "ERROR: Could not start thread");
+            atomic_store(&mt_stop, true);
+            ok = false;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    volatile int joined = 0;
+    if (exception_setup(true)) {
+        while (joined < started) {
+            pthread_join(threads[joined], NULL);
+            joined++;
+        }
+    }
+    exception_cancel();
+    if (joined < started) {
+        /* Interrupted: stop the rest, so none outlives the queue */
+        atomic_store(&mt_stop, true);
+        for (int i = joined; i < started; i++)
+            pthread_join(threads[i], NULL);
+        ok = false;
+    }
+    elapsed = delta_time(&elapsed);
+    cq_free(cq);
+
+    long count = 0;
+    size_t nsamples = 0;
+    uint64_t max_latency = 0;
+    for (int i = producers; i < nthreads; i++) {
+        count += workers[i].count;
+        nsamples += workers[i].nsamples;
+        if (workers[i].max_latency > max_latency)
+            max_latency = workers[i].max_latency;
+    }
+    uint64_t *samples = calloc_or_fail(nsamples + 1, sizeof(uint64_t), "do_mt");
+    nsamples = 0;
+    for (int i = producers; i < nthreads; i++) {
+        memcpy(samples + nsamples, workers[i].samples,
+               workers[i].nsamples * sizeof(uint64_t));
+        nsamples += workers[i].nsamples;
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+
+    if (ok && count != ops) {
+        report(1, "ERROR: Produced %d items, but consumed %ld", ops, count);
+        ok = false;
+    }
+    report(1, "%ld items in %.3f s, %.0f ops/sec", count, elapsed,
+           elapsed > 0 ? count / elapsed : 0);
+    if (nsamples)
+        report(1, "Latency p50 %lu ns, p99 %lu ns, max %lu ns",
+               (unsigned long) samples[nsamples / 2],
+               (unsigned long) samples[nsamples * 99 / 100],
+               (unsigned long) max_latency);
+
+    free_array(samples, nsamples + 1, sizeof(uint64_t));
+    free_array(workers, nthreads, sizeof(mt_worker_t));
+    return ok && !error_check();
+}
+
+/* Operations the gen command draws from */
+typedef enum {
+    GEN_IH,
+    GEN_IT,
+    GEN_RH,
+    GEN_RT,
+    GEN_REVERSE,
+    GEN_SORT,
+    GEN_NR_OPS,
+} gen_op_t;
+
+static const char *gen_op_names[GEN_NR_OPS] = {"ih", "it",      "rh",
+                                               "rt", "reverse", "sort"};
+
+/* String length distributions of the gen command */
+typedef enum { GEN_FIXED, GEN_UNIFORM, GEN_ZIPF } gen_len_t;
+
+/* Recent keys kept by gen, from which duplicates are drawn */
+#define GEN_KEYS 1024
+/* Longest string gen inserts, including its terminator */
+#define GEN_MAXLEN 1024
+
+/* Workload of the gen command */
+typedef struct {
+    int weights[GEN_NR_OPS]; /* Relative frequency of each operation */
+    int total_weight;
+    gen_len_t len_kind;
+    size_t min_len, max_len;
+    double zipf_s;           /* Exponent of the Zipf distribution */
+    double *zipf_cdf;        /* Probability of each length or less */
+    int dup;                 /* Percent of insertions repeating a key */
+    int phases;
+} gen_spec_t;
+
+/* Kept outside the stack frames that the time limit can unwind */
+static char gen_keys[GEN_KEYS][GEN_MAXLEN];
+static size_t gen_nkeys, gen_next_key;
+static int64_t gen_counts[GEN_NR_OPS];
+static int64_t gen_empty;
+
+/* Uniformly distributed double in [0, 1) */
+static double gen_uniform()
+{
+    return (prng_next() >> 11) * 0x1p-53;
+}
+
+static size_t gen_draw_len(const gen_spec_t *spec)
+{
+    switch (spec->len_kind) {
+    case GEN_UNIFORM:
+        return spec->min_len +
+               prng_below(spec->max_len - spec->min_len + 1);
+    case GEN_ZIPF: {
+        /* Smallest length whose cumulative probability exceeds u */
+        double u = gen_uniform();
+        size_t lo = 0, hi = spec->max_len - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (spec->zipf_cdf[mid] <= u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo + 1;
+    }
+    default:
+        return spec->min_len;
+    }
+}
+
+/* Fresh random key, or a recent one dup percent of the time */
+static char *gen_key(const gen_spec_t *spec)
+{
+    if (gen_nkeys && (int) prng_below(100) < spec->dup)
+        return gen_keys[prng_below(gen_nkeys)];
+
+    char *key = gen_keys[gen_next_key];
+    gen_next_key = (gen_next_key + 1) % GEN_KEYS;
+    if (gen_nkeys < GEN_KEYS)
+        gen_nkeys++;
+    size_t len = gen_draw_len(spec);
+    for (size_t i = 0; i < len; i++)
+        key[i] = charset[prng_below(sizeof charset - 1)];
+    key[len] = '\0';
+    return key;
+}
+
+static gen_op_t gen_pick(const gen_spec_t *spec)
+{
+    int w = prng_below(spec->total_weight);
+    gen_op_t op = GEN_IH;
+    while (w >= spec->weights[op])
+        w -= spec->weights[op++];
+    return op;
+}
+
+/* Parse len=fixed:L, len=uniform:MIN:MAX or len=zipf:S:MAX */
+static bool gen_parse_len(char *val, gen_spec_t *spec)
+{
+    size_t a, b;
+    double s;
+    int end = 0;
+    if (sscanf(val, "fixed:%zu%n", &a, &end) == 1 && !val[end]) {
+        spec->len_kind = GEN_FIXED;
+        spec->min_len = spec->max_len = a;
+    } else if (sscanf(val, "uniform:%zu:%zu%n", &a, &b, &end) == 2 &&
+               !val[end] && a <= b) {
+        spec->len_kind = GEN_UNIFORM;
+        spec->min_len = a;
+        spec->max_len = b;
+    } else if (sscanf(val, "zipf:%lf:%zu%n", &s, &b, &end) == 2 &&
+               !val[end] && s > 0 && b > 0) {
+        spec->len_kind = GEN_ZIPF;
+        spec->zipf_s = s;
+        spec->min_len = 1;
+        spec->max_len = b;
+    } else {
+        return false;
+    }
+    return spec->min_len > 0 && spec->max_len < GEN_MAXLEN;
+}
+
+/* Whether the key of setting s, len characters long, is name */
+static bool gen_key_is(const char *s, size_t len, const char *name)
+{
+    return strlen(name) == len && strncmp(s, name, len) == 0;
+}
+
+/*
+ * Parse the key=value settings of gen into spec.  Operations without a
+ * weight are left out, unless no operation has one.  The settings are only
+ * read, since a binary trace may hand the same strings to later commands.
+ */
+static bool gen_parse(int argc, char *argv[], gen_spec_t *spec)
+{
+    bool weighted = false;
+    for (int i = 2; i < argc; i++) {
+        size_t len = strcspn(argv[i], "=");
+        if (!argv[i][len]) {
+            report(1, "Expected key=value, not '%s'", argv[i]);
+            return false;
+        }
+        char *val = argv[i] + len + 1;
+
+        int op = 0;
+        while (op < GEN_NR_OPS && !gen_key_is(argv[i], len, gen_op_names[op]))
+            op++;
+        if (op < GEN_NR_OPS) {
+            if (!weighted)
+                memset(spec->weights, 0, sizeof(spec->weights));
+            weighted = true;
+            if (!get_int(val, &spec->weights[op]) || spec->weights[op] < 0) {
+                report(1, "Invalid weight '%s' of %s", val,
+                       gen_op_names[op]);
+                return false;
+            }
+        } else if (gen_key_is(argv[i], len, "len")) {
+            if (!gen_parse_len(val, spec)) {
+                report(1, "Invalid length distribution '%s'", val);
+                return false;
+            }
+        } else if (gen_key_is(argv[i], len, "dup")) {
+            if (!get_int(val, &spec->dup) || spec->dup < 0 ||
+                spec->dup > 100) {
+                report(1, "Invalid duplicate percentage '%s'", val);
+                return false;
             }
+        } else if (gen_key_is(argv[i], len, "phases")) {
+            if (!get_int(val, &spec->phases) || spec->phases < 1) {
+                report(1, "Invalid number of phases '%s'", val);
+                return false;
+            }
+        } else {
+            report(1, "Unknown workload setting '%.*s'", (int) len, argv[i]);
+            return false;
+        }
+    }
+
+    spec->total_weight = 0;
+    for (int op = 0; op < GEN_NR_OPS; op++)
+        spec->total_weight += spec->weights[op];
+    if (spec->total_weight == 0) {
+        report(1, "At least one operation needs a weight");
+        return false;
+    }
+    return true;
+}
+
+/* Perform one operation of the workload.  Return false on error */
+static bool gen_step(gen_op_t op, const gen_spec_t *spec)
+{
+    char buf[GEN_MAXLEN];
+    char *key;
+    uint64_t hash;
+    bool rval;
+
+    gen_counts[op]++;
+    switch (op) {
+    case GEN_IH:
+    case GEN_IT:
+        key = gen_key(spec);
+        rval = op == GEN_IH ? q_insert_head(q, key) : q_insert_tail(q, key);
+        if (rval) {
+            qcnt++;
+            shadow_insert(key);
+        } else if (++fail_count < fail_limit) {
+            report(2, "Insertion failed");
+        } else {
+            report(1, "ERROR: Insertion failed (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        break;
+    case GEN_RH:
+    case GEN_RT:
+        if (!qcnt) {
+            gen_empty++;
+            break;
+        }
+        key = op == GEN_RH ? q_peek_head(q) : q_peek_tail(q);
+        hash = key ? str_hash(key) : 0;
+        rval = op == GEN_RH ? q_remove_head(q, buf, sizeof(buf))
+                            : q_remove_tail(q, buf, sizeof(buf));
+        if (!rval) {
+            report(1, "ERROR: Removal from queue of %zu elements failed",
+                   qcnt);
+            return false;
+        }
+        qcnt--;
+        shadow_remove(hash);
+        break;
+    default:
+        set_noallocate_mode(true);
+        if (op == GEN_REVERSE)
+            q_reverse(q);
+        else
+            q_sort(q);
+        set_noallocate_mode(false);
+        qsorted = op == GEN_SORT || qcnt < 2;
+        break;
+    }
+    return !error_check();
+}
+
+static bool do_gen(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs at least 1 argument", argv[0]);
+        return false;
+    }
+
+    int64_t ops;
+    if (!get_int64(argv[1], &ops) || ops < 1) {
+        report(1, "Invalid number of operations '%s'", argv[1]);
+        return false;
+    }
+
+    gen_spec_t spec = {
+        .weights = {1, 1, 1, 1, 0, 0},
+        .len_kind = GEN_UNIFORM,
+        .min_len = MIN_RANDSTR_LEN,
+        .max_len = MAX_RANDSTR_LEN - 1,
+        .phases = 1,
+    };
+    if (!gen_parse(argc, argv, &spec))
+        return false;
+    if (!q) {
+        report(1, "%s needs a queue, create one with new", argv[0]);
+        return false;
+    }
+
+    if (spec.len_kind == GEN_ZIPF) {
+        spec.zipf_cdf =
+            malloc_or_fail(spec.max_len * sizeof(double), "do_gen");
+        double sum = 0;
+        for (size_t k = 0; k < spec.max_len; k++) {
+            sum += pow(k + 1, -spec.zipf_s);
+            spec.zipf_cdf[k] = sum;
         }
+        for (size_t k = 0; k < spec.max_len; k++)
+            spec.zipf_cdf[k] /= sum;
+    }
+    gen_nkeys = gen_next_key = 0;
+    error_check();
+
+    bool ok = true;
+    for (int p = 0; ok && p < spec.phases; p++) {
+        int64_t cnt = ops / spec.phases + (p < ops % spec.phases);
+        memset(gen_counts, 0, sizeof(gen_counts));
+        gen_empty = 0;
+
+        /* Each phase gets the time limit of a command */
+        double elapsed;
+        init_time(&elapsed);
+        if (exception_setup(true)) {
+            for (int64_t i = 0; ok && i < cnt; i++)
+                ok = gen_step(gen_pick(&spec), &spec);
+        }
+        exception_cancel();
+        elapsed = delta_time(&elapsed);
+        ok = ok && !error_check();
+
+        int64_t done = 0;
+        for (int op = 0; op < GEN_NR_OPS; op++)
+            done += gen_counts[op];
+        report(1, "Phase %d: %" PRId64 " ops in %.3f s, %.0f ops/sec", p + 1,
+               done, elapsed, elapsed > 0 ? done / elapsed : 0);
+        report_noreturn(2, "  ");
+        for (int op = 0; op < GEN_NR_OPS; op++)
+            report_noreturn(2, "%s %" PRId64 ", ", gen_op_names[op],
+                            gen_counts[op]);
+        report(2, "%" PRId64 " removals from empty queue, %zu elements",
+               gen_empty, qcnt);
     }
 
+    if (spec.zipf_cdf)
+        free_array(spec.zipf_cdf, spec.max_len, sizeof(double));
     show_queue(3);
+    return ok && verify_change();
+}
+
+/*
+ * Snapshot file of this process, for save and load without a file name, so
+ * that traces run concurrently don't overwrite each other's snapshots.
+ * Removed on quit.
+ */
+static char scratch_snapshot[] = "/tmp/qtest-XXXXXX.snapshot";
+static bool scratch_created = false;
+
+/*
+ * File name given to save or load, or else the scratch snapshot.
+ * Return NULL if the scratch snapshot could not be created.
+ */
+static const char *snapshot_name(int argc, char *argv[])
+{
+    if (argc == 2)
+        return argv[1];
+    if (!scratch_created) {
+        int fd = mkstemps(scratch_snapshot, strlen(".snapshot"));
+        if (fd < 0) {
+            report(1, "Couldn't create a temporary snapshot file");
+            return NULL;
+        }
+        close(fd);
+        scratch_created = true;
+    }
+    return scratch_snapshot;
+}
+
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (!q) {
+        report(1, "%s needs a queue, create one with new", argv[0]);
+        return false;
+    }
+    const char *file_name = snapshot_name(argc, argv);
+    if (!file_name)
+        return false;
+
+    bool ok = false;
+    error_check();
+    if (exception_setup(true))
+        ok = snapshot_save(q, file_name);
+    exception_cancel();
+
+    if (!ok)
+        report(1, "Couldn't write snapshot to '%s'", file_name);
     return ok && !error_check();
 }
 
+static bool do_load(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (!q) {
+        report(1, "%s needs a queue, create one with new", argv[0]);
+        return false;
+    }
+    const char *file_name = snapshot_name(argc, argv);
+    if (!file_name)
+        return false;
+
+    snapshot_t snap;
+    if (!snapshot_open(&snap, file_name))
+        return false;
+
+    char *strs[BULK_BATCH];
+    size_t cnt;
+    bool ok = true;
+    error_check();
+    /* Every batch gets a time limit of its own, so big snapshots can load */
+    while (ok && (cnt = snapshot_read(&snap, strs, BULK_BATCH)) > 0) {
+        ok = false;
+        if (exception_setup(true))
+            ok = insert_batch(true, strs, cnt, "snapshot strings");
+        exception_cancel();
+    }
+    snapshot_close(&snap);
+
+    show_queue(3);
+    return ok && verify_change();
+}
+
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 1) {
+        memstat_show(1);
+    } else if (!memstat_export(argv[1])) {
+        report(1, "Couldn't write allocation profile to '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    bool reset = argc == 2 && strcmp(argv[1], "reset") == 0;
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "%s takes no argument other than reset", argv[0]);
+        return false;
+    }
+
+    qstats_flush();
+    if (reset) {
+        memset(&qstats, 0, sizeof(qstats));
+        hw_ncmds = 0;
+        return true;
+    }
+
+    if (QSTATS_ENABLED) {
+        double calls = qstats.cmp_calls ? (double) qstats.cmp_calls : 1;
+        report(1,
+               "Sort runs %" PRIu64 ", steps %" PRIu64
+               ", elements visited %" PRIu64,
+               qstats.sort_runs, qstats.sort_steps, qstats.sort_visits);
+        report(1, "Comparisons %" PRIu64 ", calling strcmp %" PRIu64,
+               qstats.cmp_calls, qstats.strcmp_calls);
+        report(1, "Comparisons past the first %d bytes %" PRIu64 " (%.1f%%)",
+               QSTATS_PREFIX, qstats.cmp_long, 100 * qstats.cmp_long / calls);
+        report(1, "Bytes copied in %" PRIu64 ", out %" PRIu64,
+               qstats.bytes_in, qstats.bytes_out);
+    } else {
+        report(1, "Queue counters are not compiled in, build with make "
+                  "STATS=1");
+    }
+
+    if (hw_ncmds)
+        report(1, "Hardware events per call:");
+    for (size_t i = 0; i < hw_ncmds; i++) {
+        hw_cmd_t *c = &hw_cmds[i];
+        report_noreturn(1, "  %-12s %8" PRIu64 " calls", c->name, c->calls);
+        for (int k = 0; k < HW_EVENTS; k++)
+            report_noreturn(1, ", %.1f %s", (double) c->events[k] / c->calls,
+                            hw_event_names[k]);
+        report(1, "");
+    }
+    return true;
+}
+
+/* Check if the words of argv, joined by single spaces, spell out name */
+static bool match_words(const char *name, int argc, char *argv[])
+{
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        if (strncasecmp(name, argv[i], len) != 0)
+            return false;
+        name += len;
+        if (i < argc - 1 && *name++ != ' ')
+            return false;
+    }
+    return *name == '\0';
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs at least 1 argument", argv[0]);
+        return false;
+    }
+
+    const dut_op_t *op = dut_find_op(argv[1]);
+    if (!op) {
+        report_noreturn(1, "Unknown operation '%s'.  Choose from", argv[1]);
+        for (op = dut_ops; op->name; op++)
+            report_noreturn(1, " %s", op->name);
+        report(1, "");
+        return false;
+    }
+
+    complexity_t c = measure_complexity(op);
+    report(1, "%s appears to be %s", op->name, complexity_name(c));
+    if (argc > 2 && !match_words(complexity_name(c), argc - 2, argv + 2)) {
+        report(1, "ERROR: %s was expected to grow differently", op->name);
+        return false;
+    }
+    return true;
+}
+
 static bool show_queue(int vlevel)
 {
     bool ok = true;
     if (verblevel < vlevel)
         return true;
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!q) {
         report(vlevel, "q = NULL");
         return true;
     }
 
     report_noreturn(vlevel, "q = [");
-    list_ele_t *e = q->head;
+    q_iter_t it;
+    q_iter_init(&it, q);
+    char *e = q_iter_next(&it);
     if (exception_setup(true)) {
         while (ok && e && cnt < qcnt) {
-            if (cnt < big_queue_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-            e = e->next;
+            if (cnt < (size_t) big_queue_size)
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e);
+            e = q_iter_next(&it);
             cnt++;
             ok = ok && !error_check();
         }
@@ -601,22 +1690,69 @@ static bool show_queue(int vlevel)
     }
 
     if (!e) {
-        if (cnt <= big_queue_size)
+        if (cnt <= (size_t) big_queue_size)
             report(vlevel, "]");
         else
             report(vlevel, " ... ]");
     } else {
         report(vlevel, " ... ]");
-        report(
-            vlevel,
-            "ERROR:  Either list has cycle, or queue has more than %d elements",
-            qcnt);
+        report(vlevel,
+               "ERROR:  Either list has cycle, or queue has more than %zu "
+               "elements",
+               qcnt);
         ok = false;
     }
 
     return ok;
 }
 
+/*
+ * Walk the queue and check it against what commands expect it to hold: its
+ * length, the hash of its contents and, after sort, its order.
+ */
+static bool verify_queue()
+{
+    if (!q)
+        return true;
+
+    size_t cnt = 0;
+    uint64_t h = 0;
+    bool ordered = true, walked = false;
+    error_check();
+    if (exception_setup(true)) {
+        q_iter_t it;
+        q_iter_init(&it, q);
+        char *prev = NULL, *cur;
+        /* Stop one past the expected length, in case of a cycle */
+        while (cnt <= qcnt && (cur = q_iter_next(&it))) {
+            h += str_hash(cur);
+            if (prev && strcasecmp(prev, cur) > 0)
+                ordered = false;
+            prev = cur;
+            cnt++;
+        }
+        walked = true;
+    }
+    exception_cancel();
+    verify_changes = 0;
+
+    bool ok = walked;
+    if (!walked) {
+        /* Reported as an exception */
+    } else if (cnt != qcnt) {
+        report(1, "ERROR: Found %s%zu elements in queue, but expected %zu",
+               cnt > qcnt ? "more than " : "", cnt > qcnt ? qcnt : cnt, qcnt);
+        ok = false;
+    } else if (h != qhash) {
+        report(1, "ERROR: Queue holds other strings than were inserted");
+        ok = false;
+    } else if (qsorted && !ordered) {
+        report(1, "ERROR: Not sorted in ascending order");
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -632,6 +1768,8 @@ static void sigsegvhandler(int sig)
     report(1,
            "Segmentation fault occurred.  You dereferenced a NULL or invalid "
            "pointer");
+    /* Nothing buffered survives abort */
+    report_flush();
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -647,14 +1785,19 @@ static void queue_init()
 {
     fail_count = 0;
     q = NULL;
+    qcnt = 0;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
 }
 
-static bool queue_quit(int argc, char *argv[])
+/* File the allocation profile is saved to on exit, if any */
+static char *memstat_file = NULL;
+
+/* Free queue, and check that nothing else is left allocated */
+static bool queue_release()
 {
     report(3, "Freeing queue");
-    if (qcnt > big_queue_size)
+    if (qcnt > (size_t) big_queue_size)
         set_cautious_mode(false);
 
     if (exception_setup(true))
@@ -672,13 +1815,43 @@ static bool queue_quit(int argc, char *argv[])
     return true;
 }
 
+static bool queue_quit(int argc, char *argv[])
+{
+    if (scratch_created) {
+        unlink(scratch_snapshot);
+        scratch_created = false;
+    }
+    if (!verify_queue() || !queue_release())
+        return false;
+
+    if (memstat_file && !memstat_export(memstat_file)) {
+        report(1, "Couldn't write allocation profile to '%s'", memstat_file);
+        return false;
+    }
+
+    return true;
+}
+
+static bool queue_reset(int argc, char *argv[])
+{
+    bool ok = queue_release();
+    queue_init();
+    harness_reset();
+    return ok;
+}
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-b BFILE][-c CFILE][-v VLEVEL]"
+           "[-l LFILE][-m MFILE]\n",
+           cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Run commands from binary trace BFILE\n");
+    printf("\t-c CFILE   Compile commands into binary trace CFILE and exit\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-m MFILE   Save allocation profile to MFILE on exit\n");
     exit(0);
 }
 
@@ -726,10 +1899,15 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char mbuf[BUFSIZE];
+    char bbuf[BUFSIZE];
+    char *binfile_name = NULL;
+    char cbuf[BUFSIZE];
+    char *compile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:b:c:l:m:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -739,6 +1917,16 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            binfile_name = bbuf;
+            break;
+        case 'c':
+            strncpy(cbuf, optarg, BUFSIZE);
+            cbuf[BUFSIZE - 1] = '\0';
+            compile_name = cbuf;
+            break;
         case 'v':
             level = atoi(optarg);
             break;
@@ -747,6 +1935,12 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'm':
+            strncpy(mbuf, optarg, BUFSIZE);
+            mbuf[BUFSIZE - 1] = '\0';
+            memstat_file = mbuf;
+            memprof = 1;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -754,11 +1948,13 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
     queue_init();
     init_cmd();
     console_init();
 
+    if (compile_name)
+        return compile_trace(infile_name, compile_name) ? 0 : 1;
+
     set_verblevel(level);
     if (level > 1) {
         set_echo(true);
@@ -767,9 +1963,15 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(queue_quit);
+    add_reset_helper(queue_reset);
+    set_cmd_hook(command_started);
+    set_cmd_done_hook(command_done);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (binfile_name)
+        ok = ok && run_binary(binfile_name);
+    else
+        ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
 
     return ok ? 0 : 1;
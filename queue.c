@@ -1,18 +1,28 @@
-#include <limits.h>
-#include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "harness.h"
+#include "qstats.h"
 #include "queue.h"
+#include "strcopy.h"
 
-// From "Common vulnerabilities guide for C programmers"
-// Use strlcpy instead of strcpy to avoid overwrite
-// https://security.web.cern.ch/recommendations/en/codetools/c.shtml
-#ifndef strlcpy
-#define strlcpy(dst, src, sz) snprintf((dst), (sz), "%s", (src))
+int sort_algo = SORT_MERGE;
+int sort_threads = 1;
+qstats_t qstats;
+#ifdef QUEUE_STATS
+__thread qstats_t qstats_thread;
 #endif
 
+/* Structure of given type whose member field is at address ptr */
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) -offsetof(type, member)))
+
+/* Links of element e towards the tail and towards the head of queue q */
+#define NEXT(q, e) (*((q)->reversed ? &(e)->prev : &(e)->next))
+#define PREV(q, e) (*((q)->reversed ? &(e)->next : &(e)->prev))
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
@@ -22,8 +32,14 @@ queue_t *q_new()
     queue_t *q = malloc(sizeof(queue_t));
     if (!q)
         return NULL;
+    q->pool = test_pool_new();
+    if (!q->pool) {
+        free(q);
+        return NULL;
+    }
     q->head = q->tail = NULL;
     q->size = 0;
+    q->reversed = false;
     return q;
 }
 
@@ -33,14 +49,69 @@ void q_free(queue_t *q)
     if (!q)
         return;
 
-    while (q->head) {
-        list_ele_t *tmp = q->head;
-        q->head = q->head->next;
-        free(tmp->value);
-        free(tmp);
+    /* Elements all live in the pool, so there is no need to walk the list */
+    test_pool_release(q->pool);
+    free(q);
+}
+
+/* Start iterating over q, which may be NULL */
+void q_iter_init(q_iter_t *it, const queue_t *q)
+{
+    it->q = q;
+    it->pos = q ? q->head : NULL;
+    it->index = 0;
+}
+
+/* Return next string in queue order, or NULL once past the tail */
+char *q_iter_next(q_iter_t *it)
+{
+    list_ele_t *e = it->pos;
+    if (!e)
+        return NULL;
+    it->pos = q_next(it->q, e);
+    it->index++;
+    return e->value;
+}
+
+/* Return string at head or tail of queue, NULL if q is NULL or empty */
+char *q_peek_head(const queue_t *q)
+{
+    return q && q->head ? q->head->value : NULL;
+}
+
+char *q_peek_tail(const queue_t *q)
+{
+    return q && q->tail ? q->tail->value : NULL;
+}
+
+/* Big-endian value of the first bytes of s, zero padded past its end */
+static uint64_t prefix_key(const char *s, size_t len)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(key); i++) {
+        key <<= 8;
+        if (i < len)
+            key |= (unsigned char) s[i];
     }
+    return key;
+}
 
-    free(q);
+/*
+ * Allocate a list element with string s copied inline.
+ * Return NULL if could not allocate space.
+ */
+static list_ele_t *ele_new(queue_t *q, char *s)
+{
+    size_t len = strlen(s) + 1;
+    list_ele_t *e = test_pool_malloc(q->pool, sizeof(list_ele_t) + len);
+    if (!e)
+        return NULL;
+
+    memcpy(e->value, s, len);
+    e->key = prefix_key(s, len);
+    QSTATS_ADD(bytes_in, len);
+    QSTATS_PROBE1(insert, len);
+    return e;
 }
 
 /*
@@ -52,30 +123,21 @@ void q_free(queue_t *q)
  */
 bool q_insert_head(queue_t *q, char *s)
 {
-    if (!q || q->size == INT_MAX)
+    if (!q)
         return false;
 
-    // strlen calculates the lenght of C string
-    //(without including the terminating null character itself).
-    int strLen = strlen(s) + 1;
-    list_ele_t *newHead = (list_ele_t *) malloc(sizeof(list_ele_t));
-    char *val = (char *) malloc(sizeof(char) * strLen);
-
-    // either one of malloc fail to allocate memory
-    if (!newHead || !val) {
-        free(newHead);
-        free(val);
+    list_ele_t *newHead = ele_new(q, s);
+    if (!newHead)
         return false;
-    }
-
-    strlcpy(val, s, strLen);
 
-    newHead->value = val;
-    newHead->next = q->head;
-    q->head = newHead;
+    NEXT(q, newHead) = q->head;
+    PREV(q, newHead) = NULL;
     if (q->size == 0) {  // empty queue
         q->tail = newHead;
+    } else {
+        PREV(q, q->head) = newHead;
     }
+    q->head = newHead;
     q->size++;
 
     return true;
@@ -90,28 +152,19 @@ bool q_insert_head(queue_t *q, char *s)
  */
 bool q_insert_tail(queue_t *q, char *s)
 {
-    if (!q || q->size == INT_MAX)
+    if (!q)
         return false;
 
-    int strLen = strlen(s) + 1;
-    list_ele_t *newTail = (list_ele_t *) malloc(sizeof(list_ele_t));
-    char *val = (char *) malloc(sizeof(char) * strLen);
-
-    if (!newTail || !val) {
-        free(newTail);
-        free(val);
+    list_ele_t *newTail = ele_new(q, s);
+    if (!newTail)
         return false;
-    }
-
-    strlcpy(val, s, strLen);
-
-    newTail->value = val;
-    newTail->next = NULL;
 
+    NEXT(q, newTail) = NULL;
+    PREV(q, newTail) = q->tail;
     if (q->size == 0) {  // empty queue
         q->head = newTail;
     } else {
-        q->tail->next = newTail;
+        NEXT(q, q->tail) = newTail;
     }
     q->tail = newTail;
     q->size++;
@@ -119,6 +172,140 @@ bool q_insert_tail(queue_t *q, char *s)
     return true;
 }
 
+/* Number of elements whose allocation is requested at a time */
+#define BULK_WINDOW 256
+
+/*
+ * Shared by q_insert_head_bulk and q_insert_tail_bulk.
+ * Elements are first built into a chain of their own, in queue order, and
+ * spliced into the queue once all of them have been allocated.
+ */
+static bool insert_bulk(queue_t *q, char **strs, size_t n, bool at_head)
+{
+    if (!q || n > SIZE_MAX - q->size)
+        return false;
+    if (n == 0)
+        return true;
+
+    list_ele_t *first = NULL, *last = NULL;
+    for (size_t i = 0; i < n; i += BULK_WINDOW) {
+        size_t cnt = n - i < BULK_WINDOW ? n - i : BULK_WINDOW;
+        size_t lens[BULK_WINDOW], sizes[BULK_WINDOW];
+        void *ptrs[BULK_WINDOW];
+        for (size_t j = 0; j < cnt; j++) {
+            lens[j] = strlen(strs[i + j]) + 1;
+            sizes[j] = sizeof(list_ele_t) + lens[j];
+        }
+
+        if (!test_pool_malloc_n(q->pool, sizes, ptrs, cnt)) {
+            while (first) {
+                list_ele_t *e = first;
+                first = NEXT(q, e);
+                free(e);
+            }
+            return false;
+        }
+
+        for (size_t j = 0; j < cnt; j++) {
+            list_ele_t *e = ptrs[j];
+            memcpy(e->value, strs[i + j], lens[j]);
+            e->key = prefix_key(e->value, lens[j]);
+            QSTATS_ADD(bytes_in, lens[j]);
+            if (at_head) {
+                NEXT(q, e) = first;
+                PREV(q, e) = NULL;
+                if (first)
+                    PREV(q, first) = e;
+                else
+                    last = e;
+                first = e;
+            } else {
+                NEXT(q, e) = NULL;
+                PREV(q, e) = last;
+                if (last)
+                    NEXT(q, last) = e;
+                else
+                    first = e;
+                last = e;
+            }
+        }
+    }
+
+    if (at_head) {
+        NEXT(q, last) = q->head;
+        if (q->head)
+            PREV(q, q->head) = last;
+        else
+            q->tail = last;
+        q->head = first;
+    } else {
+        PREV(q, first) = q->tail;
+        if (q->tail)
+            NEXT(q, q->tail) = first;
+        else
+            q->head = first;
+        q->tail = last;
+    }
+    q->size += n;
+    QSTATS_PROBE1(insert_bulk, n);
+
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at head of queue, as if by calling
+ * q_insert_head on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case
+ * the queue is left unchanged.
+ */
+bool q_insert_head_bulk(queue_t *q, char **strs, size_t n)
+{
+    return insert_bulk(q, strs, n, true);
+}
+
+/*
+ * Attempt to insert n elements at tail of queue, as if by calling
+ * q_insert_tail on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Otherwise behaves like q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(queue_t *q, char **strs, size_t n)
+{
+    return insert_bulk(q, strs, n, false);
+}
+
+/* Unlink element e from queue */
+static void ele_unlink(queue_t *q, list_ele_t *e)
+{
+    list_ele_t *next = NEXT(q, e);
+    list_ele_t *prev = PREV(q, e);
+    if (prev)
+        NEXT(q, prev) = next;
+    else
+        q->head = next;
+    if (next)
+        PREV(q, next) = prev;
+    else
+        q->tail = prev;
+    q->size--;
+}
+
+/*
+ * Unlink element e from queue and release it.
+ * If sp is non-NULL, first copy its string to *sp
+ * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ */
+static void ele_remove(queue_t *q, list_ele_t *e, char *sp, size_t bufsize)
+{
+    if (sp) {
+        copy_string(sp, e->value, bufsize);
+        QSTATS_ADD(bytes_out, bufsize ? strlen(sp) + 1 : 0);
+    }
+    QSTATS_PROBE1(remove, q->size);
+    ele_unlink(q, e);
+    free(e);
+}
+
 /*
  * Attempt to remove element from head of queue.
  * Return true if successful.
@@ -129,29 +316,52 @@ bool q_insert_tail(queue_t *q, char *s)
  */
 bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
 {
-    if (!q || !sp || !q->head)
+    if (!q || !q->head)
         return false;
 
-    list_ele_t *rmElem = q->head;
-    int strLen = strlen(rmElem->value) + 1;
-    size_t realBufSize = bufsize > strLen ? strLen : bufsize;
+    ele_remove(q, q->head, sp, bufsize);
+    return true;
+}
 
-    strlcpy(sp, rmElem->value, realBufSize);
+/*
+ * Attempt to remove element from tail of queue.
+ * Other than removing from the other end, behaves like q_remove_head.
+ */
+bool q_remove_tail(queue_t *q, char *sp, size_t bufsize)
+{
+    if (!q || !q->tail)
+        return false;
 
-    q->head = q->head->next;
-    q->size--;
+    ele_remove(q, q->tail, sp, bufsize);
+    return true;
+}
 
-    free(rmElem->value);
-    free(rmElem);
+/*
+ * Attempt to remove element from head of queue, handing its string over
+ * to the caller instead of copying it.
+ * Return the string, or NULL if queue is NULL or empty.
+ */
+char *q_pop_head(queue_t *q)
+{
+    if (!q || !q->head)
+        return NULL;
 
-    return true;
+    list_ele_t *e = q->head;
+    ele_unlink(q, e);
+    return e->value;
+}
+
+/* Release string s obtained from q_pop_head, along with its element */
+void q_release(char *s)
+{
+    free(container_of(s, list_ele_t, value));
 }
 
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
  */
-int q_size(queue_t *q)
+size_t q_size(queue_t *q)
 {
     if (!q)
         return 0;
@@ -172,101 +382,285 @@ void q_reverse(queue_t *q)
         return;
 
     list_ele_t *tmp = q->head;
-    list_ele_t *prev = NULL;
-
-    while (q->head != NULL) {
-        list_ele_t *next = q->head->next;
-        q->head->next = prev;
-
-        prev = q->head;
-        q->head = next;
-    }
-
     q->head = q->tail;
     q->tail = tmp;
+    q->reversed = !q->reversed;
 }
 
 
 inline bool list_cmp(list_ele_t *l1, list_ele_t *l2)
 {
     // assume *l1 and *l2 aren't NULL
+    QSTATS_ADD(cmp_calls, 1);
+    QSTATS_ADD(strcmp_calls, 1);
+    /* Equal keys not ending in a zero byte share 8 bytes, none of them 0 */
+    QSTATS_ADD(cmp_long, l1->key == l2->key && (l1->key & 0xff));
     return (strcmp(l1->value, l2->value) >= 0) ? false : true;
 }
 
-list_ele_t *merge(list_ele_t *l1, list_ele_t *l2)
+/*
+ * Same ordering as list_cmp, decided on the prefix keys whenever they
+ * differ.  Equal keys ending in a zero byte mean both strings ended within
+ * the prefix, so they are equal.
+ */
+static inline bool prefix_cmp(list_ele_t *l1, list_ele_t *l2)
 {
-    if (!l2)
-        return l1;
-    if (!l1)
-        return l2;
-
-    list_ele_t *tmp, *head;
-    if (list_cmp(l1, l2)) {
-        tmp = l1;
-        l1 = l1->next;
-    } else {
-        tmp = l2;
+    QSTATS_ADD(cmp_calls, 1);
+    if (l1->key != l2->key)
+        return l1->key < l2->key;
+    if (!(l1->key & 0xff))
+        return false;
+    QSTATS_ADD(strcmp_calls, 1);
+    QSTATS_ADD(cmp_long, 1);
+    return strcmp(l1->value + sizeof(l1->key), l2->value + sizeof(l2->key)) <
+           0;
+}
+
+/* Order in which q_sort arranges elements along their next links */
+typedef struct {
+    bool by_prefix;  /* Compare prefix keys first */
+    bool descending; /* Largest first, for queues running along prev */
+} sort_order_t;
+
+/* Whether element a belongs strictly before element b */
+static inline bool ele_before(list_ele_t *a, list_ele_t *b, sort_order_t o)
+{
+    if (o.descending) {
+        list_ele_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    return o.by_prefix ? prefix_cmp(a, b) : list_cmp(a, b);
+}
+
+/* Sorted sublist, linked both ways along next and prev, NULL at the ends */
+typedef struct {
+    list_ele_t *head, *tail;
+    size_t len;
+} run_t;
+
+/*
+ * Merge run a with run b, which follows it.
+ * Equal elements of a come first, so merging is stable.
+ */
+static run_t merge(run_t a, run_t b, sort_order_t o)
+{
+    QSTATS_ADD(sort_steps, 1);
+    run_t r = {a.head, b.tail, a.len + b.len};
+    /* Runs wholly in or against order, as from presorted input, are joined */
+    if (!ele_before(b.head, a.tail, o)) {
+        a.tail->next = b.head;
+        b.head->prev = a.tail;
+        return r;
+    }
+    if (ele_before(b.tail, a.head, o)) {
+        b.tail->next = a.head;
+        a.head->prev = b.tail;
+        r.head = b.head;
+        r.tail = a.tail;
+        return r;
+    }
+
+    list_ele_t *l1 = a.head, *l2 = b.head, *tail;
+    if (ele_before(l2, l1, o)) {
+        r.head = l2;
         l2 = l2->next;
+    } else {
+        l1 = l1->next;
     }
-    head = tmp;
+    tail = r.head;
 
     while (l1 && l2) {
-        if (list_cmp(l1, l2)) {  // compare 2 lists
-            tmp->next = l1;
-            l1 = l1->next;
-        } else {
-            tmp->next = l2;
+        list_ele_t *e;
+        if (ele_before(l2, l1, o)) {
+            e = l2;
             l2 = l2->next;
+        } else {
+            e = l1;
+            l1 = l1->next;
         }
-        tmp = tmp->next;
+        tail->next = e;
+        e->prev = tail;
+        tail = e;
+        QSTATS_ADD(sort_visits, 1);
     }
 
-    if (!l1)
-        tmp->next = l2;
-    if (!l2)
-        tmp->next = l1;
-
-    return head;
+    /* Whatever is left of either run goes last */
+    tail->next = l1 ? l1 : l2;
+    tail->next->prev = tail;
+    r.tail = l1 ? a.tail : b.tail;
+    return r;
 }
 
-list_ele_t *merge_sort(list_ele_t *head)
+/*
+ * Detach the run of elements in order, or strictly against it, starting at
+ * head, and set *rest to the element after it.  Runs against the order are
+ * reversed, which keeps the sort stable since no two of their elements are
+ * equal.
+ */
+static run_t next_run(list_ele_t *head, sort_order_t o, list_ele_t **rest)
 {
-    if (!head || !head->next)
-        return head;
+    run_t r = {head, head, 1};
+    list_ele_t *e = head->next;
+    head->prev = NULL;
+
+    if (e && ele_before(e, head, o)) {
+        head->next = NULL;
+        while (e && ele_before(e, r.head, o)) {
+            list_ele_t *next = e->next;
+            e->next = r.head;
+            r.head->prev = e;
+            r.head = e;
+            r.len++;
+            e = next;
+            QSTATS_ADD(sort_visits, 1);
+        }
+        r.head->prev = NULL;
+    } else {
+        while (e && !ele_before(e, r.tail, o)) {
+            e->prev = r.tail;
+            r.tail = e;
+            r.len++;
+            e = e->next;
+            QSTATS_ADD(sort_visits, 1);
+        }
+        r.tail->next = NULL;
+    }
+
+    QSTATS_ADD(sort_runs, 1);
+    *rest = e;
+    return r;
+}
 
-    list_ele_t *fast = head->next;
-    list_ele_t *slow = head;
+/* Most pending runs, whose lengths more than double down the stack */
+#define MAX_RUNS 64
 
-    // split list
-    while (fast && fast->next) {
-        slow = slow->next;
-        fast = fast->next->next;
+/*
+ * Bottom-up natural merge sort of the list starting at head.
+ * Runs are taken from the list as they come and pushed onto a stack,
+ * merging the top two while the lower one is no more than twice as long.
+ * This keeps merges balanced, so that sorting takes O(n log n) time, and
+ * O(n) on input made of a few runs.  Extra space is only the stack.
+ */
+static run_t natural_merge_sort(list_ele_t *head, sort_order_t o)
+{
+    run_t stack[MAX_RUNS];
+    int n = 0;
+
+    while (head) {
+        stack[n++] = next_run(head, o, &head);
+        while (n > 1 && stack[n - 2].len <= 2 * stack[n - 1].len) {
+            stack[n - 2] = merge(stack[n - 2], stack[n - 1], o);
+            n--;
+        }
     }
-    fast = slow->next;
-    slow->next = NULL;
+    for (; n > 1; n--)
+        stack[n - 2] = merge(stack[n - 2], stack[n - 1], o);
+    return stack[0];
+}
+
+/* Fewest elements per thread worth sorting in parallel */
+#define PARALLEL_MIN_RUN 16384
+
+/* Most threads q_sort will use */
+#define MAX_SORT_THREADS 64
+
+/* Sublist handed to another thread by parallel_merge_sort */
+typedef struct {
+    list_ele_t *head;
+    size_t len;
+    sort_order_t order;
+    int threads;
+    run_t sorted;
+} sort_job_t;
+
+static run_t parallel_merge_sort(list_ele_t *head,
+                                 size_t len,
+                                 sort_order_t o,
+                                 int threads);
 
-    // sort each list
-    list_ele_t *l1 = merge_sort(head);
-    list_ele_t *l2 = merge_sort(fast);
+static void *sort_job(void *arg)
+{
+    sort_job_t *job = arg;
+    job->sorted =
+        parallel_merge_sort(job->head, job->len, job->order, job->threads);
+    qstats_flush();
+    return NULL;
+}
 
-    // merge sorted list l1 and l2
-    return merge(l1, l2);
+/*
+ * Sort the len elements starting at head using up to threads threads: the
+ * list is split in halves recursively, and one half of each split is
+ * sorted by a new thread until each thread has a sublist of its own.
+ * Merges then proceed pairwise as the threads finish.  Nothing is
+ * allocated through the harness.
+ */
+static run_t parallel_merge_sort(list_ele_t *head,
+                                 size_t len,
+                                 sort_order_t o,
+                                 int threads)
+{
+    if (threads < 2 || len < 2)
+        return natural_merge_sort(head, o);
+
+    list_ele_t *last = head;
+    for (size_t i = 1; i < len / 2; i++)
+        last = last->next;
+    sort_job_t job = {last->next, len - len / 2, o, threads / 2};
+    last->next = NULL;
+
+    pthread_t tid;
+    bool spawned = !pthread_create(&tid, NULL, sort_job, &job);
+    if (!spawned)
+        sort_job(&job);
+
+    run_t r = parallel_merge_sort(head, len / 2, o, threads - job.threads);
+    if (spawned)
+        pthread_join(tid, NULL);
+    return merge(r, job.sorted, o);
 }
 
 /*
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
  * element, do nothing.
+ * Elements are sorted along their next links, which run from tail to head
+ * in a reversed queue.  Those are put in descending order, leaving the
+ * queue reversed, so equal elements still keep their order.
  */
 void q_sort(queue_t *q)
 {
-    if (!q || !q->head || !q->head->next)
+    if (!q || q->head == q->tail)
         return;
-
-    q->head = merge_sort(q->head);
-    list_ele_t *tmp = q->head;
-    while (tmp->next) {
-        tmp = tmp->next;
+    QSTATS_PROBE1(sort_start, q->size);
+
+    sort_order_t o = {sort_algo == SORT_PREFIX, q->reversed};
+    list_ele_t *first = q->reversed ? q->tail : q->head;
+
+    size_t runs = q->size / PARALLEL_MIN_RUN;
+    /* Clamp to [1, MAX_SORT_THREADS] before limiting to one per run */
+    int threads = sort_threads < 1 ? 1 : sort_threads;
+    if (threads > MAX_SORT_THREADS)
+        threads = MAX_SORT_THREADS;
+    if ((size_t) threads > runs)
+        threads = (int) runs;
+
+    run_t r;
+    if (threads > 1) {
+        /* Hold off the time limit alarm until every thread has finished
+         * with the list.  New threads inherit the blocked mask.
+         */
+        sigset_t set, old_set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        pthread_sigmask(SIG_BLOCK, &set, &old_set);
+        r = parallel_merge_sort(first, q->size, o, threads);
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    } else {
+        r = natural_merge_sort(first, o);
     }
-    q->tail = tmp;
+
+    q->head = q->reversed ? r.tail : r.head;
+    q->tail = q->reversed ? r.head : r.tail;
+    QSTATS_PROBE1(sort_done, q->size);
 }
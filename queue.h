@@ -5,32 +5,107 @@
  * This program implements a queue supporting both FIFO and LIFO
  * operations.
  *
- * It uses a singly-linked list to represent the set of queue elements
+ * It uses a doubly-linked list to represent the set of queue elements.
+ * Reversing the queue only flips a direction flag, so code walking the
+ * list should step with q_next rather than following next directly.
+ *
+ * Building with QUEUE_UNROLLED defined (make QUEUE_IMPL=unrolled) selects
+ * an alternative layout that keeps the strings in fixed-size chunks.
+ * Code that must work with either layout walks the queue with q_iter_t.
  */
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /* Data structure declarations */
 
-/* Linked list element (You shouldn't need to change this) */
+#ifndef QUEUE_UNROLLED
+
+/* Linked list element */
 typedef struct ELE {
-    /* Pointer to array holding string.
-     * This array needs to be explicitly allocated and freed
+    struct ELE *next, *prev;
+    /* First bytes of the string, big-endian and zero padded, for sorting */
+    uint64_t key;
+    /* String stored inline, right after the element header.
+     * The element and its string are allocated and freed as one block.
      */
-    char *value;
-    struct ELE *next;
+    char value[];
 } list_ele_t;
 
 /* Queue structure */
 typedef struct {
-    list_ele_t *head; /* Linked list of elements */
-    list_ele_t *tail; /* Linked list of elements */
-    int size;         /* size of the queue*/
+    list_ele_t *head;  /* Linked list of elements */
+    list_ele_t *tail;  /* Linked list of elements */
+    size_t size;       /* size of the queue*/
+    bool reversed;     /* List order runs along prev instead of next */
+    struct POOL *pool; /* Storage for the elements */
+} queue_t;
+
+/* Element following e in queue order, NULL if e is the tail */
+static inline list_ele_t *q_next(const queue_t *q, const list_ele_t *e)
+{
+    return q->reversed ? e->prev : e->next;
+}
+
+#else /* QUEUE_UNROLLED */
+
+/* Number of string pointers held by one chunk */
+#define CHUNK_SIZE 64
+
+/* Fixed-size block of queue storage */
+typedef struct {
+    char *value[CHUNK_SIZE];
+} chunk_t;
+
+/*
+ * Queue structure.
+ * Storage position k is slot k % CHUNK_SIZE of chunk map[k / CHUNK_SIZE].
+ * The elements occupy positions start to start + size - 1, and the chunks
+ * holding them are always allocated.
+ */
+typedef struct {
+    chunk_t **map;     /* Chunk of each block of positions, or NULL */
+    size_t map_size;   /* Number of entries in map */
+    size_t start;      /* Position of first element in storage order */
+    size_t size;       /* size of the queue*/
+    bool reversed;     /* Queue order runs from the last position down */
+    struct POOL *pool; /* Storage for the map, chunks and strings */
 } queue_t;
 
+#endif /* QUEUE_UNROLLED */
+
+/* Cursor over the strings of a queue, from head to tail */
+typedef struct {
+    const queue_t *q;
+    void *pos;    /* Next element, for layouts that have one */
+    size_t index; /* Number of strings returned so far */
+} q_iter_t;
+
+/* Sorting engines for q_sort */
+enum {
+    SORT_MERGE,  /* Merge sort comparing strings with strcmp */
+    SORT_PREFIX, /* Merge sort comparing prefix keys first */
+};
+
+/* Engine used by q_sort */
+extern int sort_algo;
+
+/* Most threads q_sort may use; large queues are sorted in parallel */
+extern int sort_threads;
+
 /* Operations on queue */
 
+/* Start iterating over q, which may be NULL */
+void q_iter_init(q_iter_t *it, const queue_t *q);
+
+/* Return next string in queue order, or NULL once past the tail */
+char *q_iter_next(q_iter_t *it);
+
+/* Return string at head or tail of queue, NULL if q is NULL or empty */
+char *q_peek_head(const queue_t *q);
+char *q_peek_tail(const queue_t *q);
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
@@ -61,6 +136,23 @@ bool q_insert_head(queue_t *q, char *s);
  */
 bool q_insert_tail(queue_t *q, char *s);
 
+/*
+ * Attempt to insert n elements at head of queue, as if by calling
+ * q_insert_head on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case
+ * the queue is left unchanged.
+ * Space for all elements is requested from the allocator in one go.
+ */
+bool q_insert_head_bulk(queue_t *q, char **strs, size_t n);
+
+/*
+ * Attempt to insert n elements at tail of queue, as if by calling
+ * q_insert_tail on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Otherwise behaves like q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(queue_t *q, char **strs, size_t n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return true if successful.
@@ -71,11 +163,29 @@ bool q_insert_tail(queue_t *q, char *s);
  */
 bool q_remove_head(queue_t *q, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove element from tail of queue.
+ * Other than removing from the other end, behaves like q_remove_head.
+ */
+bool q_remove_tail(queue_t *q, char *sp, size_t bufsize);
+
+/*
+ * Attempt to remove element from head of queue, handing its string over
+ * to the caller instead of copying it.
+ * Return the string, or NULL if queue is NULL or empty.
+ * The string remains part of the queue's storage: it must be passed to
+ * q_release once done with, and is invalid after q_free.
+ */
+char *q_pop_head(queue_t *q);
+
+/* Release string s obtained from q_pop_head */
+void q_release(char *s);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
  */
-int q_size(queue_t *q);
+size_t q_size(queue_t *q);
 
 /*
  * Reverse elements in queue
@@ -83,6 +193,7 @@ int q_size(queue_t *q);
  * This function should not allocate or free any list elements
  * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
  * It should rearrange the existing ones.
+ * Takes constant time, since only the direction of the list is flipped.
  */
 void q_reverse(queue_t *q);
 
@@ -0,0 +1,602 @@
+/*
+ * Unrolled implementation of the queue in queue.h.
+ *
+ * Instead of one list element per string, the string pointers are packed
+ * into chunks of CHUNK_SIZE slots, located through a map in the same way as
+ * a double-ended queue.  Inserting or removing at either end touches a
+ * single slot, walking the queue reads consecutive pointers, and sorting
+ * rearranges the pointers in place without allocating.
+ *
+ * Selected at build time with "make QUEUE_IMPL=unrolled".
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "qstats.h"
+#include "queue.h"
+#include "strcopy.h"
+
+/* Strings carry no prefix keys here, so every engine sorts the same way */
+int sort_algo = SORT_MERGE;
+int sort_threads = 1;
+qstats_t qstats;
+#ifdef QUEUE_STATS
+__thread qstats_t qstats_thread;
+#endif
+
+/* Number of map entries allocated for an empty queue */
+#define MIN_MAP_SIZE 8
+
+/* Storage position of the element i places after the head */
+static inline size_t position(const queue_t *q, size_t i)
+{
+    return q->reversed ? q->start + q->size - 1 - i : q->start + i;
+}
+
+static inline char **slot(const queue_t *q, size_t pos)
+{
+    return &q->map[pos / CHUNK_SIZE]->value[pos % CHUNK_SIZE];
+}
+
+/*
+ * Create empty queue.
+ * Return NULL if could not allocate space.
+ */
+queue_t *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+    q->pool = test_pool_new();
+    if (!q->pool) {
+        free(q);
+        return NULL;
+    }
+    q->map = NULL;
+    q->map_size = 0;
+    q->start = 0;
+    q->size = 0;
+    q->reversed = false;
+    return q;
+}
+
+/* Free all storage used by queue */
+void q_free(queue_t *q)
+{
+    if (!q)
+        return;
+
+    /* Map, chunks and strings all live in the pool */
+    test_pool_release(q->pool);
+    free(q);
+}
+
+/* Start iterating over q, which may be NULL */
+void q_iter_init(q_iter_t *it, const queue_t *q)
+{
+    it->q = q;
+    it->pos = NULL;
+    it->index = 0;
+}
+
+/* Return next string in queue order, or NULL once past the tail */
+char *q_iter_next(q_iter_t *it)
+{
+    const queue_t *q = it->q;
+    if (!q || it->index >= q->size)
+        return NULL;
+    return *slot(q, position(q, it->index++));
+}
+
+/* Return string at head or tail of queue, NULL if q is NULL or empty */
+char *q_peek_head(const queue_t *q)
+{
+    return q && q->size ? *slot(q, position(q, 0)) : NULL;
+}
+
+char *q_peek_tail(const queue_t *q)
+{
+    return q && q->size ? *slot(q, position(q, q->size - 1)) : NULL;
+}
+
+/*
+ * Replace the map with one twice as large, with the old entries in the
+ * middle so that both ends gain free positions.
+ * Return false if could not allocate space.
+ */
+static bool grow_map(queue_t *q)
+{
+    size_t map_size = q->map_size ? 2 * q->map_size : MIN_MAP_SIZE;
+    chunk_t **map = test_pool_malloc(q->pool, map_size * sizeof(chunk_t *));
+    if (!map)
+        return false;
+
+    size_t offset = (map_size - q->map_size) / 2;
+    memset(map, 0, map_size * sizeof(chunk_t *));
+    if (q->map) {
+        memcpy(map + offset, q->map, q->map_size * sizeof(chunk_t *));
+        free(q->map);
+    }
+    q->map = map;
+    q->map_size = map_size;
+    q->start += offset * CHUNK_SIZE;
+    return true;
+}
+
+/*
+ * Move the chunks holding elements to the middle of the map, releasing any
+ * other chunk, which can only be empty.
+ */
+static void recenter_map(queue_t *q)
+{
+    size_t lo = q->start / CHUNK_SIZE;
+    size_t n = (q->start + q->size + CHUNK_SIZE - 1) / CHUNK_SIZE - lo;
+    size_t to = (q->map_size - n) / 2;
+
+    for (size_t i = 0; i < q->map_size; i++) {
+        if (i < lo || i >= lo + n) {
+            free(q->map[i]);
+            q->map[i] = NULL;
+        }
+    }
+    memmove(q->map + to, q->map + lo, n * sizeof(chunk_t *));
+    for (size_t i = 0; i < q->map_size; i++) {
+        if (i < to || i >= to + n)
+            q->map[i] = NULL;
+    }
+    q->start = q->start - lo * CHUNK_SIZE + to * CHUNK_SIZE;
+}
+
+/*
+ * Make sure there is an allocated slot just before the first element
+ * (front) or just after the last one.  When an end of the map is reached,
+ * the map only grows if the elements take up more than half of it, so a
+ * queue used as a FIFO keeps moving back to the middle instead.
+ * Return false if could not allocate space.
+ */
+static bool reserve(queue_t *q, bool front)
+{
+    size_t end = q->start + q->size;
+    if (front ? q->start == 0 : end == q->map_size * CHUNK_SIZE) {
+        /* The elements start or end on a chunk boundary here */
+        size_t chunks = (q->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        if (q->map && 2 * chunks <= q->map_size)
+            recenter_map(q);
+        else if (!grow_map(q))
+            return false;
+    }
+
+    size_t pos = front ? q->start - 1 : q->start + q->size;
+    chunk_t **c = &q->map[pos / CHUNK_SIZE];
+    if (!*c)
+        *c = test_pool_malloc(q->pool, sizeof(chunk_t));
+    return *c != NULL;
+}
+
+/* Store s in the slot made available by reserve */
+static void push(queue_t *q, char *s, bool front)
+{
+    if (front)
+        *slot(q, --q->start) = s;
+    else
+        *slot(q, q->start + q->size) = s;
+    q->size++;
+}
+
+/* Take out the first (front) or last element, releasing its chunk if empty */
+static char *pop(queue_t *q, bool front)
+{
+    size_t pos = front ? q->start : q->start + q->size - 1;
+    char *s = *slot(q, pos);
+    if (front)
+        q->start++;
+    q->size--;
+
+    size_t edge = front ? CHUNK_SIZE - 1 : 0;
+    if (pos % CHUNK_SIZE == edge) {
+        free(q->map[pos / CHUNK_SIZE]);
+        q->map[pos / CHUNK_SIZE] = NULL;
+    }
+    return s;
+}
+
+/*
+ * Shared by q_insert_head and q_insert_tail.
+ * The head is at the front of storage unless the queue is reversed.
+ */
+static bool insert(queue_t *q, char *s, bool at_head)
+{
+    if (!q)
+        return false;
+
+    bool front = at_head != q->reversed;
+    if (!reserve(q, front))
+        return false;
+
+    size_t len = strlen(s) + 1;
+    char *newstr = test_pool_malloc(q->pool, len);
+    if (!newstr)
+        return false;
+    memcpy(newstr, s, len);
+    push(q, newstr, front);
+    QSTATS_ADD(bytes_in, len);
+    QSTATS_PROBE1(insert, len);
+
+    return true;
+}
+
+/*
+ * Attempt to insert element at head of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ * Argument s points to the string to be stored.
+ * The function must explicitly allocate space and copy the string into it.
+ */
+bool q_insert_head(queue_t *q, char *s)
+{
+    return insert(q, s, true);
+}
+
+/*
+ * Attempt to insert element at tail of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ * Argument s points to the string to be stored.
+ * The function must explicitly allocate space and copy the string into it.
+ */
+bool q_insert_tail(queue_t *q, char *s)
+{
+    return insert(q, s, false);
+}
+
+/* Number of strings whose allocation is requested at a time */
+#define BULK_WINDOW 256
+
+/*
+ * Shared by q_insert_head_bulk and q_insert_tail_bulk.
+ * Strings are pushed as they are allocated, and popped again if space runs
+ * out before all of them are in.
+ */
+static bool insert_bulk(queue_t *q, char **strs, size_t n, bool at_head)
+{
+    if (!q || n > SIZE_MAX - q->size)
+        return false;
+
+    bool front = at_head != q->reversed;
+    for (size_t i = 0; i < n; i += BULK_WINDOW) {
+        size_t cnt = n - i < BULK_WINDOW ? n - i : BULK_WINDOW;
+        size_t sizes[BULK_WINDOW];
+        void *ptrs[BULK_WINDOW];
+        for (size_t j = 0; j < cnt; j++)
+            sizes[j] = strlen(strs[i + j]) + 1;
+
+        size_t done = 0;
+        if (test_pool_malloc_n(q->pool, sizes, ptrs, cnt)) {
+            for (; done < cnt && reserve(q, front); done++) {
+                memcpy(ptrs[done], strs[i + done], sizes[done]);
+                push(q, ptrs[done], front);
+                QSTATS_ADD(bytes_in, sizes[done]);
+            }
+            if (done == cnt)
+                continue;
+            for (size_t j = done; j < cnt; j++)
+                free(ptrs[j]);
+        }
+
+        for (size_t j = 0; j < i + done; j++)
+            free(pop(q, front));
+        return false;
+    }
+    QSTATS_PROBE1(insert_bulk, n);
+
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at head of queue, as if by calling
+ * q_insert_head on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case
+ * the queue is left unchanged.
+ */
+bool q_insert_head_bulk(queue_t *q, char **strs, size_t n)
+{
+    return insert_bulk(q, strs, n, true);
+}
+
+/*
+ * Attempt to insert n elements at tail of queue, as if by calling
+ * q_insert_tail on strs[0], strs[1], ..., strs[n-1] in turn.
+ * Otherwise behaves like q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(queue_t *q, char **strs, size_t n)
+{
+    return insert_bulk(q, strs, n, false);
+}
+
+/* Shared by q_remove_head and q_remove_tail */
+static bool remove_end(queue_t *q, char *sp, size_t bufsize, bool at_head)
+{
+    if (!q || q->size == 0)
+        return false;
+
+    char *s = pop(q, at_head != q->reversed);
+    if (sp) {
+        copy_string(sp, s, bufsize);
+        QSTATS_ADD(bytes_out, bufsize ? strlen(sp) + 1 : 0);
+    }
+    QSTATS_PROBE1(remove, q->size);
+    free(s);
+    return true;
+}
+
+/*
+ * Attempt to remove element from head of queue.
+ * Return true if successful.
+ * Return false if queue is NULL or empty.
+ * If sp is non-NULL and an element is removed, copy the removed string to *sp
+ * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * The space used by the list element and the string should be freed.
+ */
+bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
+{
+    return remove_end(q, sp, bufsize, true);
+}
+
+/*
+ * Attempt to remove element from tail of queue.
+ * Other than removing from the other end, behaves like q_remove_head.
+ */
+bool q_remove_tail(queue_t *q, char *sp, size_t bufsize)
+{
+    return remove_end(q, sp, bufsize, false);
+}
+
+/*
+ * Attempt to remove element from head of queue, handing its string over
+ * to the caller instead of copying it.
+ * Return the string, or NULL if queue is NULL or empty.
+ */
+char *q_pop_head(queue_t *q)
+{
+    if (!q || q->size == 0)
+        return NULL;
+    return pop(q, !q->reversed);
+}
+
+/* Release string s obtained from q_pop_head */
+void q_release(char *s)
+{
+    free(s);
+}
+
+/*
+ * Return number of elements in queue.
+ * Return 0 if q is NULL or empty
+ */
+size_t q_size(queue_t *q)
+{
+    if (!q)
+        return 0;
+    else
+        return q->size;
+}
+
+/*
+ * Reverse elements in queue
+ * No effect if q is NULL or empty
+ * Only the direction in which storage is read is flipped.
+ */
+void q_reverse(queue_t *q)
+{
+    if (!q || q->size == 0)
+        return;
+
+    q->reversed = !q->reversed;
+}
+
+/* Ranges at most this long are finished off by insertion sort */
+#define INSERTION_THRESHOLD 16
+
+/* strcmp, counted as a comparison by sort */
+static inline int str_cmp(const char *a, const char *b)
+{
+    QSTATS_ADD(cmp_calls, 1);
+    QSTATS_ADD(strcmp_calls, 1);
+    QSTATS_ADD(cmp_long, qstats_long_cmp(a, b));
+    return strcmp(a, b);
+}
+
+static inline void swap_slots(const queue_t *q, size_t a, size_t b)
+{
+    char **x = slot(q, a), **y = slot(q, b);
+    char *tmp = *x;
+    *x = *y;
+    *y = tmp;
+}
+
+static void insertion_sort(const queue_t *q, size_t lo, size_t hi)
+{
+    for (size_t i = lo + 1; i < hi; i++) {
+        char *s = *slot(q, i);
+        size_t j = i;
+        for (; j > lo && str_cmp(*slot(q, j - 1), s) > 0; j--)
+            *slot(q, j) = *slot(q, j - 1);
+        *slot(q, j) = s;
+    }
+}
+
+static char *median(char *a, char *b, char *c)
+{
+    if (str_cmp(a, b) > 0) {
+        char *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (str_cmp(b, c) <= 0)
+        return b;
+    return str_cmp(a, c) > 0 ? a : c;
+}
+
+/* Move the string at storage position lo + i down the heap at lo */
+static void sift_down(const queue_t *q, size_t lo, size_t i, size_t n)
+{
+    char *s = *slot(q, lo + i);
+    for (size_t child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n &&
+            str_cmp(*slot(q, lo + child), *slot(q, lo + child + 1)) < 0)
+            child++;
+        if (str_cmp(s, *slot(q, lo + child)) >= 0)
+            break;
+        *slot(q, lo + i) = *slot(q, lo + child);
+    }
+    *slot(q, lo + i) = s;
+}
+
+/* Sort storage positions lo to hi - 1 by heapsort, in O(n log n) always */
+static void heap_sort(const queue_t *q, size_t lo, size_t hi)
+{
+    size_t n = hi - lo;
+    QSTATS_ADD(sort_steps, 1);
+    QSTATS_ADD(sort_visits, n);
+    for (size_t i = n / 2; i-- > 0;)
+        sift_down(q, lo, i, n);
+    while (--n > 0) {
+        swap_slots(q, lo, lo + n);
+        sift_down(q, lo, 0, n);
+    }
+}
+
+/* Fewest elements per thread worth sorting in parallel */
+#define PARALLEL_MIN_RUN 16384
+
+/* Most threads q_sort will use */
+#define MAX_SORT_THREADS 64
+
+/* Range handed to another thread by quick_sort */
+typedef struct {
+    const queue_t *q;
+    size_t lo, hi;
+    int threads;
+    int depth;
+} sort_job_t;
+
+static void quick_sort(const queue_t *q,
+                       size_t lo,
+                       size_t hi,
+                       int threads,
+                       int depth);
+
+static void *sort_job(void *arg)
+{
+    sort_job_t *job = arg;
+    quick_sort(job->q, job->lo, job->hi, job->threads, job->depth);
+    qstats_flush();
+    return NULL;
+}
+
+/*
+ * Sort storage positions lo to hi - 1, by quicksort with a three-way
+ * partition so that runs of equal strings are settled in one pass.
+ * Recursing only into the smaller side bounds the stack depth by log(n).
+ * With threads > 1, the upper side of each partition is sorted by a new
+ * thread, until every thread has a range of its own.  Once depth
+ * partitions have been taken on the way to a range, it is heapsorted
+ * instead, so that inputs defeating the median of three stay O(n log n).
+ */
+static void quick_sort(const queue_t *q,
+                       size_t lo,
+                       size_t hi,
+                       int threads,
+                       int depth)
+{
+    while (hi - lo > INSERTION_THRESHOLD) {
+        if (depth-- == 0) {
+            heap_sort(q, lo, hi);
+            return;
+        }
+        QSTATS_ADD(sort_steps, 1);
+        char *pivot = median(*slot(q, lo), *slot(q, lo + (hi - lo) / 2),
+                             *slot(q, hi - 1));
+
+        /* [lo, lt) < pivot, [lt, i) == pivot, [gt, hi) > pivot */
+        size_t lt = lo, i = lo, gt = hi;
+        while (i < gt) {
+            int cmp = str_cmp(*slot(q, i), pivot);
+            QSTATS_ADD(sort_visits, 1);
+            if (cmp < 0)
+                swap_slots(q, lt++, i++);
+            else if (cmp > 0)
+                swap_slots(q, i, --gt);
+            else
+                i++;
+        }
+
+        if (threads > 1) {
+            sort_job_t job = {q, gt, hi, threads / 2, depth};
+            pthread_t tid;
+            bool spawned = !pthread_create(&tid, NULL, sort_job, &job);
+            if (!spawned)
+                sort_job(&job);
+            quick_sort(q, lo, lt, threads - job.threads, depth);
+            if (spawned)
+                pthread_join(tid, NULL);
+            return;
+        }
+
+        if (lt - lo < hi - gt) {
+            quick_sort(q, lo, lt, 1, depth);
+            lo = gt;
+        } else {
+            quick_sort(q, gt, hi, 1, depth);
+            hi = lt;
+        }
+    }
+    insertion_sort(q, lo, hi);
+}
+
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ */
+void q_sort(queue_t *q)
+{
+    if (!q || q->size < 2)
+        return;
+    QSTATS_PROBE1(sort_start, q->size);
+
+    size_t runs = q->size / PARALLEL_MIN_RUN;
+    /* Clamp to [1, MAX_SORT_THREADS] before limiting to one per run */
+    int threads = sort_threads < 1 ? 1 : sort_threads;
+    if (threads > MAX_SORT_THREADS)
+        threads = MAX_SORT_THREADS;
+    if ((size_t) threads > runs)
+        threads = (int) runs;
+
+    /* Allow twice the partitions of a balanced quicksort */
+    int depth = 0;
+    for (size_t n = q->size; n > 1; n /= 2)
+        depth += 2;
+
+    /* Storage ends up ascending, so it is read forwards again */
+    if (threads > 1) {
+        /* Hold off the time limit alarm until every thread has finished
+         * with the queue.  New threads inherit the blocked mask.
+         */
+        sigset_t set, old_set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        pthread_sigmask(SIG_BLOCK, &set, &old_set);
+        quick_sort(q, q->start, q->start + q->size, threads, depth);
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    } else {
+        quick_sort(q, q->start, q->start + q->size, 1, depth);
+    }
+    q->reversed = false;
+    QSTATS_PROBE1(sort_done, q->size);
+}
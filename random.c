@@ -1,7 +1,9 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 /* shameless stolen from ebacs */
@@ -38,9 +40,88 @@ void randombytes(uint8_t *x, size_t how_much)
     }
 }
 
+/* xoshiro256** by Blackman and Vigna */
+static uint64_t prng_state[4];
+static bool prng_ready = false;
+
+/* Bits of one prng_next call, handed out one at a time by randombit */
+static uint64_t bit_buf;
+static int bit_cnt = 0;
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void prng_seed(uint64_t seed)
+{
+    if (!seed)
+        randombytes((uint8_t *) &seed, sizeof(seed));
+    /* Spread the seed over the state, which must not be all zero */
+    for (int i = 0; i < 4; i++)
+        prng_state[i] = splitmix64(&seed);
+    prng_ready = true;
+    bit_cnt = 0;
+}
+
+uint64_t prng_next(void)
+{
+    if (!prng_ready)
+        prng_seed(0);
+
+    uint64_t *s = prng_state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+void prng_fill(uint8_t *x, size_t xlen)
+{
+    uint64_t r;
+    for (; xlen >= sizeof(r); x += sizeof(r), xlen -= sizeof(r)) {
+        r = prng_next();
+        memcpy(x, &r, sizeof(r));
+    }
+    if (xlen) {
+        r = prng_next();
+        memcpy(x, &r, xlen);
+    }
+}
+
+/* Lemire's multiply and shift, rejecting the few values that cause bias */
+uint64_t prng_below(uint64_t n)
+{
+    __uint128_t m = (__uint128_t) prng_next() * n;
+    if ((uint64_t) m < n) {
+        uint64_t threshold = -n % n;
+        while ((uint64_t) m < threshold)
+            m = (__uint128_t) prng_next() * n;
+    }
+    return (uint64_t) (m >> 64);
+}
+
 uint8_t randombit(void)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return (ret & 1);
+    if (bit_cnt == 0) {
+        bit_buf = prng_next();
+        bit_cnt = 64;
+    }
+    uint8_t ret = bit_buf & 1;
+    bit_buf >>= 1;
+    bit_cnt--;
+    return ret;
 }
@@ -6,4 +6,21 @@
 void randombytes(uint8_t *x, size_t xlen);
 uint8_t randombit(void);
 
+/*
+ * Fast generator for test data.  Unless prng_seed is called first, it is
+ * seeded from randombytes the first time it is used.
+ */
+
+/* Restart sequence from seed, or from randombytes if seed is 0 */
+void prng_seed(uint64_t seed);
+
+/* Next 64 random bits */
+uint64_t prng_next(void);
+
+/* Fill x with xlen random bytes */
+void prng_fill(uint8_t *x, size_t xlen);
+
+/* Uniformly distributed value in [0, n), for n > 0 */
+uint64_t prng_below(uint64_t n);
+
 #endif
@@ -17,11 +17,23 @@ static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+/*
+ * Output is fully buffered, so that it reaches the files in large batches
+ * rather than one write per report, unless it goes to a terminal.  It is
+ * flushed by report_flush, by report_event, and before any fatal exit.
+ */
+#define OUT_BUFSIZE (1 << 16)
+static char verb_buf[OUT_BUFSIZE];
+static char log_buf[OUT_BUFSIZE];
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
     verbfile = vfile;
+    /* Someone watching a terminal should still see each line */
+    setvbuf(verbfile, verb_buf, isatty(fileno(verbfile)) ? _IOLBF : _IOFBF,
+            sizeof(verb_buf));
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
@@ -31,6 +43,7 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
         fputs(fail_buf, logfile);
@@ -41,15 +54,29 @@ static void (*fatal_fun)() = default_fatal_fun;
 
 void set_verblevel(int level)
 {
+    if (!verbfile)
+        init_files(stdout, stdout);
     verblevel = level;
 }
 
 bool set_logfile(char *file_name)
 {
+    /* The buffer is shared, so the old log must be closed first */
+    if (logfile)
+        fclose(logfile);
     logfile = fopen(file_name, "w");
+    if (logfile)
+        setvbuf(logfile, log_buf, _IOFBF, sizeof(log_buf));
     return logfile != NULL;
 }
 
+void report_flush()
+{
+    fflush(verbfile ? verbfile : stdout);
+    if (logfile)
+        fflush(logfile);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -78,10 +105,11 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "\n");
         fflush(logfile);
         va_end(ap);
-        fclose(logfile);
     }
 
     if (fatal) {
+        if (logfile)
+            fclose(logfile);
         if (fatal_fun)
             fatal_fun();
         exit(1);
@@ -97,15 +125,13 @@ void report(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
+        fputc('\n', verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
+            fputc('\n', logfile);
             va_end(ap);
         }
     }
@@ -120,13 +146,11 @@ void report_noreturn(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fflush(logfile);
             va_end(ap);
         }
     }
@@ -140,7 +164,8 @@ static void fail_fun(char *format, char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
-    /* Use write to avoid any buffering issues */
+    /* Use write to avoid any buffering issues, after what is buffered */
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
     if (logfile) {
@@ -280,10 +305,15 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * now_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
 }
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -31,6 +32,9 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Write out buffered output */
+void report_flush();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -58,4 +62,7 @@ void init_time(double *timep);
    and reset timer */
 double delta_time(double *timep);
 
+/* Nanoseconds on the monotonic clock */
+uint64_t now_ns();
+
 #endif /* LAB0_REPORT_H */
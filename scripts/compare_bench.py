@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+
+# Compare two result files of the bench program and flag regressions:
+# benchmarks whose time per operation grew by more than the threshold,
+# with Welch's t-test on the samples finding the change significant.
+
+import argparse
+import json
+import math
+import statistics
+import sys
+
+
+def betacf(a, b, x):
+    # Continued fraction of the incomplete beta function (Lentz's method)
+    tiny = 1e-300
+    c, d = 1.0, 1.0 - (a + b) * x / (a + 1.0)
+    d = 1.0 / (d if abs(d) > tiny else tiny)
+    h = d
+    for m in range(1, 200):
+        even = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+        odd = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))
+        for num in (even, odd):
+            d = 1.0 + num * d
+            d = 1.0 / (d if abs(d) > tiny else tiny)
+            c = 1.0 + num / c
+            c = c if abs(c) > tiny else tiny
+            h *= d * c
+        if abs(d * c - 1.0) < 1e-12:
+            break
+    return h
+
+
+def betainc(a, b, x):
+    # Regularized incomplete beta function I_x(a, b)
+    if x <= 0:
+        return 0.0
+    if x >= 1:
+        return 1.0
+    front = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) +
+                     a * math.log(x) + b * math.log(1 - x))
+    if x < (a + 1) / (a + b + 2):
+        return front * betacf(a, b, x) / a
+    return 1.0 - front * betacf(b, a, 1 - x) / b
+
+
+def welch_p(xs, ys):
+    # Two-sided p-value of Welch's t-test that xs and ys have the same mean
+    if len(xs) < 2 or len(ys) < 2:
+        return 1.0
+    vx = statistics.variance(xs) / len(xs)
+    vy = statistics.variance(ys) / len(ys)
+    if vx + vy == 0:
+        return 0.0 if statistics.mean(xs) != statistics.mean(ys) else 1.0
+    t = (statistics.mean(xs) - statistics.mean(ys)) / math.sqrt(vx + vy)
+    df = (vx + vy) ** 2 / (vx ** 2 / (len(xs) - 1) + vy ** 2 / (len(ys) - 1))
+    return betainc(df / 2, 0.5, df / (df + t * t))
+
+
+def load(name):
+    with open(name) as f:
+        data = json.load(f)
+    results = {}
+    for r in data["results"]:
+        results[(r["op"], r["strings"], r["n"])] = r
+    return data, results
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Compare two JSON files written by bench")
+    parser.add_argument("old", help="Baseline results")
+    parser.add_argument("new", help="Results to check")
+    parser.add_argument("-t", "--threshold", type=float, default=5.0,
+                        help="Smallest slowdown reported, in percent "
+                        "(default 5)")
+    parser.add_argument("-a", "--alpha", type=float, default=0.01,
+                        help="Significance level of the t-test (default 0.01)")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="Show every benchmark, not only changes")
+    args = parser.parse_args()
+
+    old_data, old = load(args.old)
+    new_data, new = load(args.new)
+    for key in ("allocator", "queue"):
+        if old_data.get(key) != new_data.get(key):
+            print("WARNING: comparing %s %s against %s" %
+                  (key, old_data.get(key), new_data.get(key)))
+
+    regressions = 0
+    print("%-16s %-6s %9s %12s %12s %8s %8s" %
+          ("op", "strs", "n", "old ns/op", "new ns/op", "change", "p"))
+    for key in sorted(old, key=lambda k: (k[1], k[2], k[0])):
+        if key not in new:
+            continue
+        xs, ys = old[key]["ns_per_op"], new[key]["ns_per_op"]
+        before, after = statistics.median(xs), statistics.median(ys)
+        change = 100.0 * (after - before) / before if before else 0.0
+        p = welch_p(xs, ys)
+        significant = p < args.alpha and abs(change) > args.threshold
+        if significant and change > 0:
+            verdict = "REGRESSION"
+            regressions += 1
+        elif significant:
+            verdict = "faster"
+        else:
+            verdict = ""
+        if verdict or args.verbose:
+            print("%-16s %-6s %9d %12.2f %12.2f %+7.1f%% %8.4f %s" %
+                  (key[0], key[1], key[2], before, after, change, p,
+                   verdict))
+
+    missing = len(set(old) ^ set(new))
+    if missing:
+        print("%d benchmarks appear in only one of the files" % missing)
+    print("%d regressions" % regressions)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -4,6 +4,7 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import threading
 
 
 
@@ -17,6 +18,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 0
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +37,19 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-concurrent",
+        19: "trace-19-gen",
+        20: "trace-20-snapshot",
+        21: "trace-21-remove-tail",
+        22: "trace-22-prefix-sort",
+        23: "trace-23-pop",
+        24: "trace-24-parallel-sort",
+        25: "trace-25-memstat",
+        26: "trace-26-latency",
+        27: "trace-27-seed",
+        28: "trace-28-complexity",
+        29: "trace-29-verify"
     }
 
     traceProbs = {
@@ -55,10 +69,22 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29"
     }
 
-    maxScores = [0, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,13 +95,15 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 jobs=0):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.jobs = jobs
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -97,6 +125,66 @@ class Tracer:
             return False
         return retcode == 0
 
+    # Persistent qtest reading commands from a pipe.  Each trace is sourced
+    # and followed by reset, which prints whether the trace passed.
+    def startWorker(self):
+        vname = "%d" % self.verbLevel
+        return subprocess.Popen(self.command + ["-v", vname, "-f", "/dev/stdin"],
+                                stdin=subprocess.PIPE,
+                                stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT,
+                                universal_newlines=True)
+
+    def runTraceOnWorker(self, worker, tid):
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        output = []
+        try:
+            worker.stdin.write("source %s\nreset\n" % fname)
+            worker.stdin.flush()
+        except (IOError, OSError):
+            pass
+        for line in worker.stdout:
+            if line.startswith("Reset: "):
+                return line.strip() == "Reset: ok", "".join(output), True
+            output.append(line)
+        # Trace ended the worker, as with quit or too many errors
+        return worker.wait() == 0, "".join(output), False
+
+    def workerLoop(self, pending, results, lock):
+        worker = None
+        while True:
+            with lock:
+                if not pending:
+                    break
+                tid = pending.pop(0)
+            if worker is None:
+                worker = self.startWorker()
+            ok, output, alive = self.runTraceOnWorker(worker, tid)
+            if not (ok and alive):
+                # Don't let a failed trace leave anything behind
+                if alive:
+                    worker.kill()
+                worker.wait()
+                worker = None
+            with lock:
+                results[tid] = (ok, output)
+        if worker is not None:
+            worker.stdin.close()
+            worker.wait()
+
+    def runParallel(self, tidList):
+        pending = list(tidList)
+        results = {}
+        lock = threading.Lock()
+        threads = [threading.Thread(target=self.workerLoop,
+                                    args=(pending, results, lock))
+                   for _ in range(min(self.jobs, len(pending)))]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return results
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
@@ -113,11 +201,16 @@ class Tracer:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
+        results = self.runParallel(tidList) if self.jobs > 0 else None
         for t in tidList:
             tname = self.traceDict[t]
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
+            if results is None:
+                ok = self.runTrace(t)
+            else:
+                ok, output = results[t]
+                sys.stdout.write(output)
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
             if tval < maxval:
@@ -145,11 +238,12 @@ class Tracer:
 
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [-j N] [--valgrind] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
+    print("  -j N      Run traces on N persistent qtest processes at once")
     print("  -c Enable colored text")
     sys.exit(0)
 
@@ -162,8 +256,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 0
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cj:', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -180,6 +275,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-j':
+            jobs = int(val)
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -189,7 +286,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               jobs=jobs)
     t.run(tid)
 
 
@@ -0,0 +1,135 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "report.h"
+#include "snapshot.h"
+
+/* Size of the stdio buffer used to write snapshots */
+#define SNAPSHOT_BUFSIZE (1 << 20)
+
+static void header_init(snapshot_header_t *h, uint64_t count, uint64_t len)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = SNAPSHOT_VERSION;
+    h->count = count;
+    h->arena_len = len;
+}
+
+bool snapshot_save(const queue_t *q, const char *file_name)
+{
+    FILE *f = fopen(file_name, "wb");
+    if (!f)
+        return false;
+    setvbuf(f, NULL, _IOFBF, SNAPSHOT_BUFSIZE);
+
+    /* The header is written again once the counts are known */
+    snapshot_header_t h;
+    header_init(&h, 0, 0);
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    uint64_t count = 0, arena_len = 0;
+    q_iter_t it;
+    q_iter_init(&it, q);
+    for (char *s; ok && (s = q_iter_next(&it));) {
+        size_t len = strlen(s);
+        uint32_t len32 = (uint32_t) len;
+        ok = len == len32 && fwrite(&len32, sizeof(len32), 1, f) == 1 &&
+             fwrite(s, 1, len + 1, f) == len + 1;
+        count++;
+        arena_len += sizeof(len32) + len + 1;
+    }
+
+    header_init(&h, count, arena_len);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        unlink(file_name);
+    return ok;
+}
+
+/* Check that the arena of s holds exactly s->count records */
+static bool snapshot_check(const snapshot_t *s)
+{
+    const char *pos = s->pos;
+    for (uint64_t i = 0; i < s->count; i++) {
+        uint32_t len;
+        if ((size_t) (s->end - pos) < sizeof(len))
+            return false;
+        memcpy(&len, pos, sizeof(len));
+        pos += sizeof(len);
+        if ((size_t) (s->end - pos) <= len || pos[len] != '\0')
+            return false;
+        pos += len + 1;
+    }
+    return pos == s->end;
+}
+
+bool snapshot_open(snapshot_t *s, const char *file_name)
+{
+    memset(s, 0, sizeof(*s));
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        report(1, "Could not open snapshot '%s'", file_name);
+        return false;
+    }
+
+    struct stat st;
+    snapshot_header_t h;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(h) ||
+        (uintmax_t) st.st_size > SIZE_MAX) {
+        close(fd);
+        report(1, "'%s' is not a queue snapshot", file_name);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "Could not map snapshot '%s'", file_name);
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    s->map = map;
+    s->map_len = st.st_size;
+
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+        report(1, "'%s' is not a queue snapshot", file_name);
+    } else if (h.version != SNAPSHOT_VERSION) {
+        report(1, "Snapshot '%s' has unsupported version %u", file_name,
+               (unsigned) h.version);
+    } else {
+        s->count = h.count;
+        s->pos = (const char *) map + sizeof(h);
+        s->end = (const char *) map + s->map_len;
+        if (h.arena_len == s->map_len - sizeof(h) && snapshot_check(s))
+            return true;
+        report(1, "Snapshot '%s' is truncated or corrupt", file_name);
+    }
+    snapshot_close(s);
+    return false;
+}
+
+size_t snapshot_read(snapshot_t *s, char **strs, size_t n)
+{
+    size_t cnt = 0;
+    /* Records have been checked by snapshot_open */
+    while (cnt < n && s->pos < s->end) {
+        uint32_t len;
+        memcpy(&len, s->pos, sizeof(len));
+        strs[cnt++] = (char *) s->pos + sizeof(len);
+        s->pos += sizeof(len) + len + 1;
+    }
+    return cnt;
+}
+
+void snapshot_close(snapshot_t *s)
+{
+    if (s->map)
+        munmap(s->map, s->map_len);
+    memset(s, 0, sizeof(*s));
+}
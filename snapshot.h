@@ -0,0 +1,60 @@
+#ifndef LAB0_SNAPSHOT_H
+#define LAB0_SNAPSHOT_H
+
+/*
+ * Queue snapshots, for building big queues without generating them.
+ *
+ * A snapshot file is a header followed by an arena of records, one per
+ * string in queue order: its length as a 32-bit integer, its characters
+ * and a terminating zero.  Integers are in native byte order.  Since the
+ * strings stay terminated in place, a mapped snapshot is handed to the bulk
+ * insertion API without copying.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+#define SNAPSHOT_MAGIC "lab0snap"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[8];      /* SNAPSHOT_MAGIC, without terminator */
+    uint32_t version;   /* SNAPSHOT_VERSION */
+    uint32_t reserved;  /* Zero */
+    uint64_t count;     /* Number of strings */
+    uint64_t arena_len; /* Bytes of records following the header */
+} snapshot_header_t;
+
+/* Snapshot file mapped for reading */
+typedef struct {
+    void *map;
+    size_t map_len;
+    uint64_t count;  /* Number of strings */
+    const char *pos; /* Next record */
+    const char *end; /* End of the arena */
+} snapshot_t;
+
+/*
+ * Write the strings of q, from head to tail, to file_name.
+ * Return true if successful.
+ */
+bool snapshot_save(const queue_t *q, const char *file_name);
+
+/*
+ * Map file_name and check that it holds a well-formed snapshot.
+ * Return true if successful, reporting what is wrong otherwise.
+ */
+bool snapshot_open(snapshot_t *s, const char *file_name);
+
+/*
+ * Point strs at the next strings of s, at most n of them.
+ * Return how many there were.  They remain valid until snapshot_close.
+ */
+size_t snapshot_read(snapshot_t *s, char **strs, size_t n);
+
+/* Unmap snapshot opened by snapshot_open */
+void snapshot_close(snapshot_t *s);
+
+#endif /* LAB0_SNAPSHOT_H */
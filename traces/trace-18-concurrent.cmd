@@ -0,0 +1,3 @@
+# Test of the concurrent queues under producer and consumer threads
+mt 2 2 10000
+mt 1 1 10000 ring
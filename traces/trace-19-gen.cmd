@@ -0,0 +1,12 @@
+# Test the workload generator: a mix of insertions and removals, with Zipf
+# string lengths and repeated keys, then a sort of the resulting queue and a
+# report of the queue counters
+option fail 0
+option malloc 0
+option seed 19
+new
+gen 400000 ih=3 it=3 rh=2 rt=2 reverse=1 len=zipf:1.1:64 dup=30 phases=4
+size
+sort
+stats
+free
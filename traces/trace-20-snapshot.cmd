@@ -0,0 +1,22 @@
+# Test of saving a queue to a snapshot and loading it back, twice over,
+# through the temporary snapshot file of this qtest process
+option fail 0
+option malloc 0
+new
+ih dolphin
+it bear
+reverse
+ih gerbil
+save
+free
+new
+load
+load
+size 1
+rh gerbil
+rh bear
+rh dolphin
+rh gerbil
+rt dolphin
+rh bear
+free
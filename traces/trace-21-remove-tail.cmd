@@ -0,0 +1,25 @@
+# Test of remove_tail, mixed with insert_head, insert_tail, reverse and
+# remove_head
+option fail 0
+option malloc 0
+new
+ih dolphin
+ih bear
+ih gerbil
+reverse
+it meerkat
+it bear
+it gerbil
+reverse
+it squirrel
+reverse
+rh squirrel
+ih vulture
+reverse
+rt vulture
+rh gerbil
+rt dolphin
+rh bear
+rh meerkat
+rt bear
+rh gerbil
@@ -0,0 +1,21 @@
+# Test of insert_head, insert_tail, size, and sort with the prefix-keyed
+# merge sort engine
+option fail 0
+option malloc 0
+new
+ih gerbil
+ih bear
+ih dolphin
+size
+it meerkat
+it bear
+it gerbil
+size
+option sortalgo 1
+sort
+rh bear
+rh
+rh
+rh
+size
+
@@ -0,0 +1,8 @@
+# Test performance of draining the queue with rhq, which takes strings over
+# without copying them
+option fail 0
+option malloc 0
+new
+ih dolphin 1000000
+rhq 1000000
+size
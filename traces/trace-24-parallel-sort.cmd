@@ -0,0 +1,12 @@
+# Test performance of insert_tail, size, reverse, and sort on 4 threads
+option fail 0
+option malloc 0
+new
+ih dolphin 1000000
+it gerbil 1000000
+size 1000
+reverse
+option sortthreads 4
+sort
+size 1000
+
@@ -0,0 +1,4 @@
+# Test that sort grows as n log n, and that a quadratic insertion sort is
+# told apart from it
+complexity sort O(n log n)
+complexity isort O(n^2)
@@ -0,0 +1,26 @@
+# Test of insert_head, insert_tail, remove_head, reverse, size, and sort,
+# with all of the queue checked after every change
+option fail 0
+option verify 1
+option malloc 0
+new
+ih dolphin
+ih bear
+ih gerbil
+reverse
+size
+it meerkat
+it bear
+it gerbil
+size
+rh dolphin
+reverse
+size
+sort
+rh bear
+rh bear
+rh gerbil
+rh gerbil
+rh meerkat
+size
+free